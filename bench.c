@@ -0,0 +1,699 @@
+// Round-trip latency and throughput benchmark against a monitor endpoint
+// (2022) Martin Hejnfelt (martin@hejnfelt.com)
+// See https://immerhax.com/?p=797 for more information
+// Licensed under the WTFPL, see LICENSE.txt
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "bkm15r.h"
+#include "monitor.h"
+
+#define BENCH_DEFAULT_ADDRESS   "127.0.0.1"
+#define BENCH_DEFAULT_COUNT     (1000)
+#define BENCH_DEFAULT_DEPTH     (MONITOR_DEFAULT_WINDOW)
+#define BENCH_WARMUP            (16)
+#define BENCH_PARSE_BYTES       (16 * 1024 * 1024)
+#define BENCH_ENCODE_FRAMES     (10 * 1000 * 1000)
+#define BENCH_FUZZ_INPUT        (2048)
+#define BENCH_READS_FRAMES      (90)
+
+struct run {
+    uint64_t *latencies;
+    unsigned done;
+    unsigned ok;
+    unsigned errors;
+};
+
+struct benchmark {
+    const char *name;
+    uint8_t (*queue)(struct monitor *mon);
+};
+
+static uint8_t queueToggle(struct monitor *mon) {
+    return monitorCommand(mon, CMD_COMB, NULL);
+}
+
+static uint8_t queueInfoButton(struct monitor *mon) {
+    return monitorCommand(mon, CMD_MENU_DOWN, NULL);
+}
+
+static uint8_t queueKnob(struct monitor *mon) {
+    return monitorKnob(mon, KNOB_BRIGHT, 1, 1, NULL);
+}
+
+static uint8_t queueStatus(struct monitor *mon) {
+    return monitorRequestStatus(mon);
+}
+
+static const struct benchmark benchmarks[] = {
+    { "status_toggle", queueToggle },
+    { "info_button",   queueInfoButton },
+    { "knob",          queueKnob },
+    { "status_poll",   queueStatus }
+};
+
+static void onComplete(struct monitor *mon, const struct request *req, int result) {
+    struct run *run = mon->user;
+    if(result == REQUEST_OK) {
+        run->latencies[run->ok++] = monitorNow() - req->sent;
+    } else {
+        run->errors++;
+    }
+    run->done++;
+}
+
+static int compareLatency(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+// Keeps the queue topped up until count requests have completed.
+// Returns the wall time taken in ns, 0 if the connection was lost
+static uint64_t drive(struct monitor *mon, const struct benchmark *b, unsigned count) {
+    struct run *run = mon->user;
+    struct pollfd pfd;
+    unsigned queued = 0;
+    uint64_t start = monitorNow();
+
+    pfd.fd = mon->fd;
+    while(run->done < count) {
+        while(queued < count && mon->count < MONITOR_MAX_QUEUE) {
+            if(b->queue(mon)) break;
+            queued++;
+        }
+        pfd.events = monitorPollEvents(mon);
+        if(poll(&pfd, 1, monitorPollTimeout(mon)) < 0 && errno != EINTR) return 0;
+        if(monitorHandleEvents(mon, pfd.revents)) return 0;
+    }
+    return monitorNow() - start;
+}
+
+static int runBenchmark(struct monitor *mon, const struct benchmark *b, const char *mode, int depth, unsigned count) {
+    struct run run;
+    uint64_t elapsed;
+
+    memset(&run, 0, sizeof(run));
+    run.latencies = calloc(count > BENCH_WARMUP ? count : BENCH_WARMUP, sizeof(uint64_t));
+    if(run.latencies == NULL) return 1;
+    mon->user = &run;
+    mon->window = depth;
+
+    if(drive(mon, b, BENCH_WARMUP) == 0) goto lost;
+    run.done = run.ok = run.errors = 0;
+
+    elapsed = drive(mon, b, count);
+    if(elapsed == 0) goto lost;
+
+    qsort(run.latencies, run.ok, sizeof(uint64_t), compareLatency);
+    fprintf(stdout,"{\"command\":\"%s\",\"mode\":\"%s\",\"depth\":%d,\"count\":%u,\"errors\":%u,"
+                   "\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f,\"per_second\":%.1f}\n",
+        b->name, mode, depth, count, run.errors,
+        run.ok ? run.latencies[run.ok / 2] / 1000.0 : 0.0,
+        run.ok ? run.latencies[(run.ok * 99) / 100] / 1000.0 : 0.0,
+        run.ok ? run.latencies[run.ok - 1] / 1000.0 : 0.0,
+        count / (elapsed / 1e9));
+    fflush(stdout);
+    free(run.latencies);
+    return 0;
+
+lost:
+    fprintf(stderr,"Lost connection to monitor during %s\n",b->name);
+    free(run.latencies);
+    return 1;
+}
+
+// Feeds a captured-like stream of status replies and acks through the frame
+// parser in uneven chunks, as recv might hand them over, without a socket
+static int runParseBenchmark(void) {
+    static const char statusReply[] = "STATret CURRENT 8420 0000 0071 00F0 0000";
+    static struct parser parser;
+    uint16_t status[STATUS_WORDS];
+    uint8_t *stream, *buf;
+    size_t length = 0, offset = 0, chunk, space;
+    unsigned frames = 0, seed = 1;
+    uint64_t start, elapsed;
+    int result;
+
+    stream = malloc(BENCH_PARSE_BYTES);
+    if(stream == NULL) return 1;
+    while(length + STATUS_RESPONSE_SIZE + 3 * BUTTON_RESPONSE_SIZE <= BENCH_PARSE_BYTES) {
+        memcpy(stream + length, header, sizeof(header));
+        stream[length + sizeof(header) - 1] = strlen(statusReply);
+        memcpy(stream + length + sizeof(header), statusReply, strlen(statusReply));
+        length += STATUS_RESPONSE_SIZE;
+        for(chunk = 0; chunk < 3; ++chunk) {
+            memcpy(stream + length, header, sizeof(header));
+            length += BUTTON_RESPONSE_SIZE;
+        }
+    }
+
+    parserInit(&parser);
+    start = monitorNow();
+    while(offset < length) {
+        seed = seed * 1103515245 + 12345;
+        chunk = 1 + (seed >> 16) % 97;
+        buf = parserWritePtr(&parser, &space);
+        if(chunk > space) chunk = space;
+        if(chunk > length - offset) chunk = length - offset;
+        memcpy(buf, stream + offset, chunk);
+        parserCommit(&parser, chunk);
+        offset += chunk;
+        while((result = parserNext(&parser, status)) != PARSE_NEED_MORE) {
+            if(result != PARSE_ACK && result != PARSE_STATUS) {
+                fprintf(stderr,"Parser lost sync at byte %zu\n",offset);
+                free(stream);
+                return 1;
+            }
+            frames++;
+        }
+    }
+    elapsed = monitorNow() - start;
+
+    fprintf(stdout,"{\"command\":\"parse\",\"frames\":%u,\"bytes\":%zu,\"ns_per_frame\":%.1f,"
+                   "\"frames_per_second\":%.0f,\"mb_per_second\":%.1f}\n",
+        frames, length, (double)elapsed / frames,
+        frames / (elapsed / 1e9), length / (elapsed / 1e9) / 1e6);
+    free(stream);
+    return 0;
+}
+
+// Encodes every knob frame there is, round robin, without a socket
+static int runEncodeBenchmark(void) {
+    uint8_t buf[sizeof(struct frame)];
+    unsigned frames = 0, i;
+    size_t bytes = 0;
+    uint64_t start, elapsed;
+
+    start = monitorNow();
+    for(i = 0; i < BENCH_ENCODE_FRAMES; ++i) {
+        bytes += encodeKnobFrame(buf, knobTargets[i % KNOB_NONE], (i & 1) ? 1 : -1, 1 + i % 255);
+        frames++;
+    }
+    elapsed = monitorNow() - start;
+
+    fprintf(stdout,"{\"command\":\"encode_knob\",\"frames\":%u,\"bytes\":%zu,\"ns_per_frame\":%.1f,"
+                   "\"frames_per_second\":%.0f}\n",
+        frames, bytes, (double)elapsed / frames, frames / (elapsed / 1e9));
+    return 0;
+}
+
+// The frames the first version of the app put on the wire, spelled out
+// rather than built from the same defines, so a change to the encoding
+// shows up here
+struct knownFrame {
+    enum Command cmd;
+    const char *payload;
+    uint8_t length;     // includes a terminating NUL where one is sent
+    uint8_t lengthByte; // what the header says, not always length
+};
+
+#define KNOWN(cmd, text)            { cmd, text, sizeof(text) - 1, sizeof(text) - 1 }
+#define KNOWN_AS(cmd, text, byte)   { cmd, text, sizeof(text) - 1, byte }
+
+static const struct knownFrame knownFrames[] = {
+    KNOWN(CMD_POWER,        "STATset POWER TOGGLE"),
+    // the length byte counts a TOGGLE that isn't sent, see knownDegauss
+    KNOWN_AS(CMD_DEGAUSS,   "STATset DEGAUSS ", 22),
+    KNOWN(CMD_SCANMODE,     "STATset SCANMODE TOGGLE"),
+    KNOWN(CMD_HDELAY,       "STATset HDELAY TOGGLE"),
+    KNOWN(CMD_VDELAY,       "STATset VDELAY TOGGLE"),
+    KNOWN(CMD_MONOCHROME,   "STATset MONOCHR TOGGLE"),
+    KNOWN(CMD_APERTURE,     "STATset APERTURE TOGGLE"),
+    KNOWN(CMD_COMB,         "STATset COMB TOGGLE"),
+    KNOWN(CMD_CHAR_OFF,     "STATset CHARMUTE TOGGLE"),
+    KNOWN(CMD_COL_TEMP,     "STATset COLADJ TOGGLE"),
+    KNOWN(CMD_ASPECT,       "STATset ASPECT TOGGLE"),
+    KNOWN(CMD_EXTSYNC,      "STATset EXTSYNC TOGGLE"),
+    KNOWN(CMD_BLUE_ONLY,    "STATset BLUEONLY TOGGLE"),
+    KNOWN(CMD_R_CUTOFF,     "STATset RCUTOFF TOGGLE"),
+    KNOWN(CMD_G_CUTOFF,     "STATset GCUTOFF TOGGLE"),
+    KNOWN(CMD_B_CUTOFF,     "STATset BCUTOFF TOGGLE"),
+    KNOWN(CMD_MARKER,       "STATset MARKER TOGGLE"),
+    KNOWN(CMD_CHROMA_UP,    "STATset CHROMAUP TOGGLE"),
+    KNOWN(CMD_MAN_PHASE,    "STATset MANPHASE TOGGLE"),
+    KNOWN(CMD_MAN_CHROMA,   "STATset MANCHR TOGGLE"),
+    KNOWN(CMD_MAN_BRIGHT,   "STATset MANBRT TOGGLE"),
+    KNOWN(CMD_MAN_CONTRAST, "STATset MANCONT TOGGLE"),
+    KNOWN(CMD_INP_ENTER,    "INFObutton ENTER "),
+    KNOWN(CMD_INP_DELETE,   "INFObutton DELETE "),
+    KNOWN(CMD_MENU,         "INFObutton MENU "),
+    KNOWN(CMD_MENU_ENTER,   "INFObutton MENUENT "),
+    KNOWN(CMD_MENU_UP,      "INFObutton MENUUP "),
+    KNOWN(CMD_MENU_DOWN,    "INFObutton MENUDOWN "),
+    KNOWN(CMD_DIGIT_0,      "INFObutton 0 "),
+    KNOWN(CMD_DIGIT_1,      "INFObutton 1 "),
+    KNOWN(CMD_DIGIT_2,      "INFObutton 2 "),
+    KNOWN(CMD_DIGIT_3,      "INFObutton 3 "),
+    KNOWN(CMD_DIGIT_4,      "INFObutton 4 "),
+    KNOWN(CMD_DIGIT_5,      "INFObutton 5 "),
+    KNOWN(CMD_DIGIT_6,      "INFObutton 6 "),
+    KNOWN(CMD_DIGIT_7,      "INFObutton 7 "),
+    KNOWN(CMD_DIGIT_8,      "INFObutton 8 "),
+    KNOWN(CMD_DIGIT_9,      "INFObutton 9 "),
+    KNOWN(CMD_STATUS_GET,   "STATget CURRENT 5\0")
+};
+
+// The status request the first version of the app sent, byte for byte
+static const uint8_t knownStatusGet[31] = {
+    0x03,0x0b,0x53,0x4f,0x4e,0x59,0x00,0x00,0x00,0xb0,0x00,0x00,0x12,0x53,0x54,0x41,
+    0x54,0x67,0x65,0x74,0x20,0x43,0x55,0x52,0x52,0x45,0x4e,0x54,0x20,0x35,0x00
+};
+
+// DEGAUSS as the first version sent it, length byte 0x16 (22) although only
+// the 16 bytes of "STATset DEGAUSS " are sent. That only holds up because
+// the engine sends nothing behind it until it's answered, see flushQueue.
+static const uint8_t knownDegauss[29] = {
+    0x03,0x0b,0x53,0x4f,0x4e,0x59,0x00,0x00,0x00,0xb0,0x00,0x00,0x16,0x53,0x54,0x41,
+    0x54,0x73,0x65,0x74,0x20,0x44,0x45,0x47,0x41,0x55,0x53,0x53,0x20
+};
+
+static const char *knownKnobTargets[KNOB_NONE] = {
+    "R PHASE", "R CHROMA", "R BRIGHTNESS", "R CONTRAST"
+};
+
+static unsigned failures = 0;
+
+static void check(int ok, const char *what, unsigned value) {
+    if(ok) return;
+    fprintf(stderr,"FAIL: %s (%u)\n",what,value);
+    failures++;
+}
+
+static size_t buildFrame(uint8_t *buf, const char *payload, uint8_t length) {
+    memcpy(buf, header, sizeof(header) - 1);
+    buf[sizeof(header) - 1] = length;
+    memcpy(buf + sizeof(header), payload, length);
+    return sizeof(header) + length;
+}
+
+static void verifyCommands(void) {
+    uint8_t expected[sizeof(header) + UINT8_MAX];
+    size_t length;
+    unsigned i;
+
+    check(sizeof(knownFrames)/sizeof(knownFrames[0]) == CMD_COUNT, "every command has a known frame", CMD_COUNT);
+    for(i = 0; i < sizeof(knownFrames)/sizeof(knownFrames[0]); ++i) {
+        length = buildFrame(expected, knownFrames[i].payload, knownFrames[i].length);
+        expected[sizeof(header) - 1] = knownFrames[i].lengthByte;
+        check(commandLength(knownFrames[i].cmd) == length, "command length", knownFrames[i].cmd);
+        check(!memcmp(commandData(knownFrames[i].cmd), expected, length), "command bytes", knownFrames[i].cmd);
+    }
+    check(commandLength(CMD_STATUS_GET) == sizeof(knownStatusGet) &&
+        !memcmp(commandData(CMD_STATUS_GET), knownStatusGet, sizeof(knownStatusGet)), "STATget bytes", 0);
+    check(commandLength(CMD_DEGAUSS) == sizeof(knownDegauss) &&
+        !memcmp(commandData(CMD_DEGAUSS), knownDegauss, sizeof(knownDegauss)), "DEGAUSS bytes", 0);
+}
+
+// Every knob, direction and tick count against the format the first
+// version of the app put together with snprintf
+static void verifyKnobs(void) {
+    uint8_t buf[sizeof(struct frame)], expected[sizeof(header) + UINT8_MAX];
+    char payload[64];
+    size_t length;
+    int knob, dir, ticks;
+
+    for(knob = 0; knob < KNOB_NONE; ++knob) {
+        check(!strcmp(knobTargets[knob], knownKnobTargets[knob]), "knob target", knob);
+        for(dir = -1; dir <= 1; dir += 2) {
+            for(ticks = 0; ticks <= UINT8_MAX; ++ticks) {
+                snprintf(payload, sizeof(payload), "INFOknob %s 96/%d/%d", knownKnobTargets[knob], dir, ticks);
+                length = buildFrame(expected, payload, strlen(payload));
+                check(encodeKnobFrame(buf, knobTargets[knob], dir, ticks) == length &&
+                    !memcmp(buf, expected, length), "knob frame", ticks);
+            }
+        }
+    }
+    // too long for a frame is refused rather than written past the buffer
+    check(encodeKnobFrame(buf, "R A KNOB NAME FAR TOO LONG TO FIT", 1, 1) == 0, "oversized knob refused", 0);
+}
+
+// Feeds bytes through a parser and expects one result after the other,
+// checking the status words are only touched by a status result
+static void expectParse(const char *what, const uint8_t *data, size_t length, const int *results, const uint16_t *words) {
+    struct parser parser;
+    uint16_t status[STATUS_WORDS], before[STATUS_WORDS];
+    size_t space;
+    uint8_t *buf;
+    int result, i;
+
+    parserInit(&parser);
+    buf = parserWritePtr(&parser, &space);
+    if(length > space) {
+        check(0, what, length);
+        return;
+    }
+    memcpy(buf, data, length);
+    parserCommit(&parser, length);
+    memset(status, 0xAA, sizeof(status));
+    for(i = 0;; ++i) {
+        memcpy(before, status, sizeof(status));
+        result = parserNext(&parser, status);
+        check(result == results[i], what, i);
+        if(result != results[i] || result == PARSE_NEED_MORE) break;
+        if(result == PARSE_STATUS) {
+            check(!memcmp(status, words, sizeof(status)), what, i);
+        } else {
+            check(!memcmp(status, before, sizeof(status)), what, i);
+        }
+    }
+}
+
+static void verifyParser(void) {
+    static const int status[] = { PARSE_STATUS, PARSE_NEED_MORE };
+    static const int bad[] = { PARSE_BAD_FRAME, PARSE_NEED_MORE };
+    static const int ack[] = { PARSE_ACK, PARSE_NEED_MORE };
+    static const int other[] = { PARSE_OTHER, PARSE_NEED_MORE };
+    static const int resync[] = { PARSE_BAD, PARSE_BAD, PARSE_STATUS, PARSE_ACK, PARSE_NEED_MORE };
+    static const int partial[] = { PARSE_NEED_MORE };
+    static const uint16_t words[STATUS_WORDS] = { 0x8420, 0x0000, 0x0071, 0x00F0, 0xBEEF };
+    static const char *good = "STATret CURRENT 8420 0000 0071 00F0 BEEF";
+    static const char *lower = "STATret CURRENT 8420 0000 0071 00f0 beef";
+    static const char *broken[] = {
+        "STATret CURRENT 8420 0000 0071 00F0 BEEG",    // not hex
+        "STATret CURRENT 8420 0000 0071 00F0 BEE ",
+        "STATret CURRENT 8420-0000 0071 00F0 BEEF",    // words run together
+        "STATret CURRENT 84200 000 0071 00F0 BEEF",
+        "STATset CURRENT 8420 0000 0071 00F0 BEEF",    // not a status reply
+        "INFObutton 12345678 8420 0000 0071 00F0 BEEF"
+    };
+    uint8_t stream[4 * (sizeof(header) + UINT8_MAX)];
+    size_t length;
+    unsigned i;
+
+    length = buildFrame(stream, good, strlen(good));
+    check(length == STATUS_RESPONSE_SIZE, "status reply size", length);
+    expectParse("status reply", stream, length, status, words);
+    length = buildFrame(stream, lower, strlen(lower));
+    expectParse("lower case status reply", stream, length, status, words);
+    for(i = 0; i < sizeof(broken)/sizeof(broken[0]); ++i) {
+        length = buildFrame(stream, broken[i], STATUS_RESPONSE_SIZE - sizeof(header));
+        expectParse(broken[i], stream, length, bad, words);
+    }
+    length = buildFrame(stream, "", 0);
+    expectParse("ack", stream, length, ack, words);
+    length = buildFrame(stream, "STATret CURRENT 8420", 20);
+    expectParse("short status", stream, length, other, words);
+
+    // a length byte promising more than arrived waits for the rest
+    length = buildFrame(stream, good, strlen(good));
+    stream[sizeof(header) - 1] = UINT8_MAX;
+    expectParse("truncated frame", stream, length, partial, words);
+
+    // garbage, then a header cut short, then good frames
+    memcpy(stream, "\x03\x0BSO\x01\x02", 6);
+    memcpy(stream + 6, "\x03\x0BSONX", 6);
+    length = 12 + buildFrame(stream + 12, good, strlen(good));
+    length += buildFrame(stream + length, "", 0);
+    expectParse("resync", stream, length, resync, words);
+}
+
+// A run of status replies and acks several times the size of the ring,
+// fed in every chunk size from a byte at a time to as much as fits, so
+// frames are split across reads, many arrive in one read and the ring
+// wraps under frames at every offset
+static void verifyParserReads(void) {
+    uint8_t stream[BENCH_READS_FRAMES * STATUS_RESPONSE_SIZE];
+    uint16_t words[BENCH_READS_FRAMES][STATUS_WORDS], status[STATUS_WORDS];
+    char payload[64];
+    struct parser parser;
+    size_t length = 0, offset, chunk, space;
+    unsigned i, frame, wrong;
+    uint8_t *buf;
+    int result;
+
+    for(i = 0; i < BENCH_READS_FRAMES; ++i) {
+        if(i % 3 == 2) {
+            length += buildFrame(stream + length, "", 0);
+            continue;
+        }
+        words[i][0] = POWER_ON_STATUS | i;
+        words[i][1] = 0xABCD;
+        words[i][2] = 0x00EF;
+        words[i][3] = (i * 0x0101) & 0xFFFF;
+        words[i][4] = 0xF00D;
+        snprintf(payload, sizeof(payload), "STATret CURRENT %.04X %.04X %.04X %.04X %.04X",
+            words[i][0],words[i][1],words[i][2],words[i][3],words[i][4]);
+        length += buildFrame(stream + length, payload, strlen(payload));
+    }
+    check(length > 2 * PARSER_RING_SIZE, "reads stream wraps the ring", length);
+
+    for(chunk = 1; chunk <= PARSER_RING_SIZE; chunk = chunk < 64 ? chunk + 1 : chunk * 2) {
+        parserInit(&parser);
+        frame = 0;
+        wrong = 0;
+        for(offset = 0; offset < length;) {
+            buf = parserWritePtr(&parser, &space);
+            if(space == 0) {
+                wrong++;
+                break;
+            }
+            if(space > chunk) space = chunk;
+            if(space > length - offset) space = length - offset;
+            memcpy(buf, stream + offset, space);
+            parserCommit(&parser, space);
+            offset += space;
+            while((result = parserNext(&parser, status)) != PARSE_NEED_MORE) {
+                if(frame == BENCH_READS_FRAMES) {
+                    wrong++;
+                } else if(frame % 3 == 2) {
+                    wrong += result != PARSE_ACK;
+                } else {
+                    wrong += result != PARSE_STATUS || memcmp(status, words[frame], sizeof(status));
+                }
+                frame++;
+            }
+        }
+        check(wrong == 0 && frame == BENCH_READS_FRAMES, "frames split and coalesced across reads", chunk);
+    }
+}
+
+struct engineRun {
+    int results[2];
+    unsigned done;
+};
+
+static void onEngineComplete(struct monitor *mon, const struct request *req, int result) {
+    struct engineRun *run = mon->user;
+    (void)req;
+    if(run->done < 2) run->results[run->done] = result;
+    run->done++;
+}
+
+static void onEngineMessage(struct monitor *mon, const char *text) {
+    (void)mon;
+    (void)text;
+}
+
+// A status reply that is framed right but won't decode still answers the
+// request it was sent for, so the ack right behind it goes to the command
+// queued after, over a socket pair standing in for the monitor
+static void verifyEngine(void) {
+    static const char *bad = "STATret CURRENT 8420 0000 0071 00F0 BEEG";
+    uint8_t stream[2 * (sizeof(header) + UINT8_MAX)];
+    struct engineRun run;
+    struct monitor mon;
+    size_t length;
+    int pair[2];
+
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, pair)) {
+        check(0, "engine socket pair", errno);
+        return;
+    }
+    memset(&run, 0, sizeof(run));
+    run.results[0] = run.results[1] = -1;
+    monitorInit(&mon);
+    mon.fd = pair[0];
+    mon.user = &run;
+    mon.onComplete = onEngineComplete;
+    mon.onMessage = onEngineMessage;
+    check(!monitorRequestStatus(&mon) && !monitorCommand(&mon, CMD_COMB, NULL), "engine queue", mon.count);
+    check(!monitorHandleEvents(&mon, 0) && mon.inflight == 2, "engine pipelined", mon.inflight);
+
+    length = buildFrame(stream, bad, STATUS_RESPONSE_SIZE - sizeof(header));
+    length += buildFrame(stream + length, "", 0);
+    check(write(pair[1], stream, length) == (ssize_t)length, "engine replies", length);
+    check(!monitorHandleEvents(&mon, POLLIN), "engine bad status frame", 0);
+    check(run.done == 2, "bad status frame answers its request", run.done);
+    check(run.results[0] == REQUEST_FAILED, "bad status frame fails the status", run.results[0]);
+    check(run.results[1] == REQUEST_OK, "ack after bad status frame", run.results[1]);
+    check(mon.count == 0 && mon.stats.malformed == 1, "engine queue drained", mon.count);
+
+    monitorClose(&mon);
+    close(pair[1]);
+}
+
+static int runVerify(void) {
+    verifyCommands();
+    verifyKnobs();
+    verifyParser();
+    verifyParserReads();
+    verifyEngine();
+    fprintf(stdout,"{\"command\":\"verify\",\"failures\":%u}\n",failures);
+    return failures != 0;
+}
+
+// Runs arbitrary bytes through the parser in chunks sized by the input
+// itself, then a clean status reply, which must come out right whatever
+// came before it. Returns 1 if anything was off.
+static int fuzzParser(const uint8_t *data, size_t size) {
+    static const char *good = "STATret CURRENT 8420 0000 0071 00F0 BEEF";
+    static const uint16_t words[STATUS_WORDS] = { 0x8420, 0x0000, 0x0071, 0x00F0, 0xBEEF };
+    static struct parser parser;
+    uint8_t tail[2 * (sizeof(header) + UINT8_MAX)];
+    uint16_t status[STATUS_WORDS], before[STATUS_WORDS];
+    size_t offset = 0, chunk, space, length;
+    uint8_t *buf;
+    int result, pass, decoded = 0;
+
+    // whatever was buffered is padded out to a complete frame, junk that
+    // gets skipped, and the reply follows
+    memset(tail, 0, sizeof(header) + UINT8_MAX);
+    length = sizeof(header) + UINT8_MAX;
+    length += buildFrame(tail + length, good, strlen(good));
+
+    parserInit(&parser);
+    memset(status, 0xAA, sizeof(status));
+    for(pass = 0; pass < 2; ++pass) {
+        while(offset < size) {
+            chunk = 1 + data[offset] % 64;
+            buf = parserWritePtr(&parser, &space);
+            if(space == 0) return 1;
+            if(chunk > space) chunk = space;
+            if(chunk > size - offset) chunk = size - offset;
+            memcpy(buf, data + offset, chunk);
+            parserCommit(&parser, chunk);
+            offset += chunk;
+            for(;;) {
+                memcpy(before, status, sizeof(status));
+                result = parserNext(&parser, status);
+                if(parser.tail - parser.head > PARSER_RING_SIZE) return 1;
+                if(result != PARSE_STATUS && memcmp(status, before, sizeof(status))) return 1;
+                if(result == PARSE_NEED_MORE) break;
+                if(pass == 1 && result == PARSE_STATUS) decoded = !memcmp(status, words, sizeof(words));
+            }
+        }
+        data = tail;
+        size = length;
+        offset = 0;
+    }
+    return !decoded;
+}
+
+#ifdef FUZZ_PARSER
+// libFuzzer, or AFL++ in its libFuzzer mode, instead of main
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    if(fuzzParser(data, size)) abort();
+    return 0;
+}
+#endif
+
+// Valid frames with random bytes flipped, dropped and made up, for when
+// there is no fuzzer at hand. Build with -fsanitize=address to catch reads
+// outside the ring.
+static int runFuzz(unsigned iterations) {
+    static const char *good = "STATret CURRENT 8420 0000 0071 00F0 BEEF";
+    uint8_t input[BENCH_FUZZ_INPUT];
+    size_t length;
+    unsigned i, j, seed = 1, failed = 0;
+
+    for(i = 0; i < iterations; ++i) {
+        length = 0;
+        while(length + STATUS_RESPONSE_SIZE <= sizeof(input) - BENCH_FUZZ_INPUT / 4) {
+            seed = seed * 1103515245 + 12345;
+            if((seed >> 16) % 3 == 0) {
+                length += buildFrame(input + length, "", 0);
+            } else {
+                length += buildFrame(input + length, good, strlen(good));
+            }
+        }
+        for(j = 0; j < 1 + i % 16; ++j) {
+            seed = seed * 1103515245 + 12345;
+            switch((seed >> 8) % 4) {
+                case 0: // flip a byte
+                    input[(seed >> 12) % length] ^= 1 + (seed >> 20) % 255;
+                break;
+                case 1: // a length byte anywhere from nothing to the maximum
+                    input[(seed >> 12) % length] = (seed >> 20) & 0xFF;
+                break;
+                case 2: // cut short
+                    length -= (seed >> 12) % (length / 2);
+                break;
+                default: // junk appended
+                    while(length < sizeof(input) && (seed >> 16) % 8) {
+                        seed = seed * 1103515245 + 12345;
+                        input[length++] = seed >> 24;
+                    }
+                break;
+            }
+        }
+        if(fuzzParser(input, length)) {
+            fprintf(stderr,"FAIL: parser off after fuzz input %u\n",i);
+            failed++;
+        }
+    }
+    fprintf(stdout,"{\"command\":\"fuzz\",\"inputs\":%u,\"failures\":%u}\n",iterations,failed);
+    return failed != 0;
+}
+
+#ifndef FUZZ_PARSER
+int main(int argc, char *argv[])
+{
+    struct monitor mon;
+    const char *address = BENCH_DEFAULT_ADDRESS;
+    int port = MONITOR_PORT;
+    int depth = BENCH_DEFAULT_DEPTH;
+    unsigned count = BENCH_DEFAULT_COUNT;
+    unsigned i;
+    int opt, rc = 0;
+
+    while((opt = getopt(argc, argv, "a:p:n:d:PVF:")) != -1) {
+        switch(opt) {
+            case 'a':
+                address = optarg;
+            break;
+            case 'p':
+                port = atoi(optarg);
+            break;
+            case 'n':
+                count = atoi(optarg);
+            break;
+            case 'd':
+                depth = atoi(optarg);
+                if(depth < 1) depth = 1;
+                if(depth > MONITOR_MAX_QUEUE) depth = MONITOR_MAX_QUEUE;
+            break;
+            case 'P':
+                return runParseBenchmark() || runEncodeBenchmark() ? 3 : 0;
+            case 'V':
+                return runVerify() ? 3 : 0;
+            case 'F':
+                return runFuzz(atoi(optarg)) ? 3 : 0;
+            default:
+                fprintf(stderr,"Usage: %s [-a address] [-p port] [-n requests per run] [-d pipeline depth] [-P parser and encoder only] [-V check frames against known bytes] [-F fuzz inputs]\n",argv[0]);
+                return 1;
+        }
+    }
+
+    monitorInit(&mon);
+    mon.onComplete = onComplete;
+    if(monitorConnect(&mon, address, port)) {
+        fprintf(stderr,"Could not connect to %s:%d\n",address,port);
+        return 2;
+    }
+
+    // one JSON object per line, serial first then pipelined
+    for(i = 0; i < sizeof(benchmarks)/sizeof(benchmarks[0]) && rc == 0; ++i) {
+        rc = runBenchmark(&mon, &benchmarks[i], "serial", 1, count);
+        if(rc == 0) rc = runBenchmark(&mon, &benchmarks[i], "pipelined", depth, count);
+    }
+
+    monitorClose(&mon);
+    return rc ? 3 : 0;
+}
+#endif
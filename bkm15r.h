@@ -0,0 +1,143 @@
+// BKM-15R protocol definitions
+// (2022) Martin Hejnfelt (martin@hejnfelt.com)
+// See https://immerhax.com/?p=797 for more information
+// Licensed under the WTFPL, see LICENSE.txt
+
+#ifndef BKM15R_H
+#define BKM15R_H
+
+#include <stdint.h>
+
+#define MONITOR_PORT (53484)
+
+// status word 1
+#define POWER_ON_STATUS     (0x8000)
+#define SCANMODE_STATUS     (0x0400)
+#define HDELAY_STATUS       (0x0200)
+#define VDELAY_STATUS       (0x0100)
+#define MONOCHROME_STATUS   (0x0080)
+#define CHAR_MUTE_STATUS    (0x0040)
+#define MARKER_MODE_STATUS  (0x0020)
+#define EXTSYNC_STATUS      (0x0010)
+#define APT_STATUS          (0x0008)
+#define CHROMA_UP_STATUS    (0x0004)
+#define ASPECT_STATUS       (0x0002)
+
+// status word 2
+// Unknown / unused
+
+// status word 3
+#define COL_TEMP_STATUS     (0x0040)
+#define COMB_STATUS         (0x0020)
+#define BLUE_ONLY_STATUS    (0x0010)
+#define R_CUTOFF_STATUS     (0x0004)
+#define G_CUTOFF_STATUS     (0x0002)
+#define B_CUTOFF_STATUS     (0x0001)
+
+// status word 4
+#define MAN_PHASE_STATUS    (0x0080)
+#define MAN_CHROMA_STATUS   (0x0040)
+#define MAN_BRIGHT_STATUS   (0x0020)
+#define MAN_CONTRAST_STATUS (0x0010)
+
+// status word 5
+// Unknown / unused
+
+// Status buttons
+#define POWER_BUTTON        "POWER"
+#define DEGAUSS_BUTTON      "DEGAUSS"
+
+#define SCANMODE_BUTTON     "SCANMODE"
+#define HDELAY_BUTTON       "HDELAY"
+#define VDELAY_BUTTON       "VDELAY"
+#define MONOCHROME_BUTTON   "MONOCHR"
+#define APERTURE_BUTTON     "APERTURE"
+#define COMB_BUTTON         "COMB"
+#define CHAR_OFF_BUTTON     "CHARMUTE"
+#define COL_TEMP_BUTTON     "COLADJ"
+
+#define ASPECT_BUTTON       "ASPECT"
+#define EXTSYNC_BUTTON      "EXTSYNC"
+#define BLUE_ONLY_BUTTON    "BLUEONLY"
+#define R_CUTOFF_BUTTON     "RCUTOFF"
+#define G_CUTOFF_BUTTON     "GCUTOFF"
+#define B_CUTOFF_BUTTON     "BCUTOFF"
+#define MARKER_BUTTON       "MARKER"
+#define CHROMA_UP_BUTTON    "CHROMAUP"
+
+#define MAN_PHASE_BUTTON    "MANPHASE"
+#define MAN_CHROMA_BUTTON   "MANCHR"
+#define MAN_BRIGHT_BUTTON   "MANBRT"
+#define MAN_CONTRAST_BUTTON "MANCONT"
+
+#define TOGGLE              "TOGGLE"
+#define CURRENT             "CURRENT"
+#define STATUS_GET          "STATget"
+#define STATUS_SET          "STATset"
+#define STATUS_RETURN       "STATret"
+
+// Info buttons/knobs
+#define INFO_INP_ENTER      "ENTER"
+#define INFO_INP_DELETE     "DELETE"
+#define INFO_NAV_MENU       "MENU"
+#define INFO_NAV_MENUENT    "MENUENT"
+#define INFO_NAV_MENUUP     "MENUUP"
+#define INFO_NAV_MENUDOWN   "MENUDOWN"
+
+#define INFO_BUTTON         "INFObutton"
+
+#define INFO_KNOB_PHASE         "R PHASE"
+#define INFO_KNOB_CHROMA        "R CHROMA"
+#define INFO_KNOB_BRIGHTNESS    "R BRIGHTNESS"
+#define INFO_KNOB_CONTRAST      "R CONTRAST"
+
+#define INFO_KNOB           "INFOknob"
+
+// Every frame starts with this header, the last byte carrying the length
+// of the payload that follows
+#define FRAME_HEADER 0x03, 0x0B, 'S', 'O', 'N', 'Y', 0x00, 0x00, 0x00, 0xB0, 0x00, 0x00
+static const char header [13] = { FRAME_HEADER, 0x00 };
+
+// Status buttons and the status bit each one toggles, word is 0 based
+struct statusButton {
+    const char *name;
+    uint8_t word;
+    uint16_t mask;
+};
+
+static const struct statusButton statusButtons[] = {
+    { POWER_BUTTON,        0, POWER_ON_STATUS },
+    { SCANMODE_BUTTON,     0, SCANMODE_STATUS },
+    { HDELAY_BUTTON,       0, HDELAY_STATUS },
+    { VDELAY_BUTTON,       0, VDELAY_STATUS },
+    { MONOCHROME_BUTTON,   0, MONOCHROME_STATUS },
+    { CHAR_OFF_BUTTON,     0, CHAR_MUTE_STATUS },
+    { MARKER_BUTTON,       0, MARKER_MODE_STATUS },
+    { EXTSYNC_BUTTON,      0, EXTSYNC_STATUS },
+    { APERTURE_BUTTON,     0, APT_STATUS },
+    { CHROMA_UP_BUTTON,    0, CHROMA_UP_STATUS },
+    { ASPECT_BUTTON,       0, ASPECT_STATUS },
+    { COL_TEMP_BUTTON,     2, COL_TEMP_STATUS },
+    { COMB_BUTTON,         2, COMB_STATUS },
+    { BLUE_ONLY_BUTTON,    2, BLUE_ONLY_STATUS },
+    { R_CUTOFF_BUTTON,     2, R_CUTOFF_STATUS },
+    { G_CUTOFF_BUTTON,     2, G_CUTOFF_STATUS },
+    { B_CUTOFF_BUTTON,     2, B_CUTOFF_STATUS },
+    { MAN_PHASE_BUTTON,    3, MAN_PHASE_STATUS },
+    { MAN_CHROMA_BUTTON,   3, MAN_CHROMA_STATUS },
+    { MAN_BRIGHT_BUTTON,   3, MAN_BRIGHT_STATUS },
+    { MAN_CONTRAST_BUTTON, 3, MAN_CONTRAST_STATUS }
+};
+
+#define STATUS_BUTTON_COUNT (sizeof(statusButtons)/sizeof(statusButtons[0]))
+
+#define STATUS_RESPONSE_SIZE (53)
+#define BUTTON_RESPONSE_SIZE (13)
+
+// The five status words are sent as 4 hex digits each, space separated,
+// starting at this offset into the status response
+#define STATUS_WORD_OFFSET   (29)
+#define STATUS_WORD_STRIDE   (5)
+#define STATUS_WORDS         (5)
+
+#endif
@@ -0,0 +1,73 @@
+// Wire traffic capture, timestamped frames in a compact binary file
+// (2022) Martin Hejnfelt (martin@hejnfelt.com)
+// See https://immerhax.com/?p=797 for more information
+// Licensed under the WTFPL, see LICENSE.txt
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "capture.h"
+
+// Records are small, let stdio batch them into big writes, but not hold
+// on to them for long, whatever is in the buffer is lost if the app dies
+#define CAPTURE_BUFFER_SIZE (64 * 1024)
+#define CAPTURE_FLUSH_MS    (250)
+
+int captureOpen(struct capture *cap, const char *path) {
+    cap->f = fopen(path, "wb");
+    if(cap->f == NULL) {
+        fprintf(stderr,"Could not create capture %s\n",path);
+        return 1;
+    }
+    setvbuf(cap->f, NULL, _IOFBF, CAPTURE_BUFFER_SIZE);
+    cap->flushedAt = 0;
+    fwrite(CAPTURE_MAGIC, 1, CAPTURE_MAGIC_SIZE, cap->f);
+    return 0;
+}
+
+void captureWrite(struct capture *cap, uint8_t direction, uint8_t channel, const uint8_t *data, size_t length) {
+    struct captureRecord rec;
+    struct timespec ts;
+
+    if(cap == NULL || cap->f == NULL) return;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    rec.ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    rec.direction = direction;
+    rec.channel = channel;
+    rec.length = length > UINT16_MAX ? UINT16_MAX : length;
+    fwrite(&rec, sizeof(rec), 1, cap->f);
+    fwrite(data, 1, rec.length, cap->f);
+    if(rec.ns - cap->flushedAt >= CAPTURE_FLUSH_MS * 1000000ULL) {
+        fflush(cap->f);
+        cap->flushedAt = rec.ns;
+    }
+}
+
+void captureClose(struct capture *cap) {
+    if(cap->f == NULL) return;
+    fclose(cap->f);
+    cap->f = NULL;
+}
+
+int captureOpenRead(struct capture *cap, const char *path) {
+    char magic[CAPTURE_MAGIC_SIZE];
+
+    cap->f = fopen(path, "rb");
+    if(cap->f == NULL) {
+        fprintf(stderr,"Could not open capture %s\n",path);
+        return 1;
+    }
+    if(fread(magic, 1, sizeof(magic), cap->f) != sizeof(magic) || memcmp(magic, CAPTURE_MAGIC, sizeof(magic))) {
+        fprintf(stderr,"%s is not a capture\n",path);
+        captureClose(cap);
+        return 1;
+    }
+    return 0;
+}
+
+int captureRead(struct capture *cap, struct captureRecord *rec, uint8_t *data) {
+    if(fread(rec, sizeof(*rec), 1, cap->f) != 1) return 1;
+    if(fread(data, 1, rec->length, cap->f) != rec->length) return 1;
+    return 0;
+}
@@ -0,0 +1,44 @@
+// Wire traffic capture, timestamped frames in a compact binary file
+// (2022) Martin Hejnfelt (martin@hejnfelt.com)
+// See https://immerhax.com/?p=797 for more information
+// Licensed under the WTFPL, see LICENSE.txt
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+// The file starts with CAPTURE_MAGIC, then one record per frame sent or
+// chunk received, each a struct captureRecord followed by length bytes.
+// Fields are in host byte order.
+#define CAPTURE_MAGIC       "BKMCAP1\n"
+#define CAPTURE_MAGIC_SIZE  (8)
+
+enum CaptureDirection {
+    CAPTURE_OUT,    // a complete frame written to the monitor
+    CAPTURE_IN      // bytes as they were read from the monitor
+};
+
+struct captureRecord {
+    uint64_t ns;        // CLOCK_MONOTONIC
+    uint8_t direction;  // enum CaptureDirection
+    uint8_t channel;    // which monitor, in the order they were given
+    uint16_t length;
+} __attribute__((packed));
+
+struct capture {
+    FILE *f;
+    uint64_t flushedAt;     // ns, CLOCK_MONOTONIC
+};
+
+int captureOpen(struct capture *cap, const char *path);
+void captureWrite(struct capture *cap, uint8_t direction, uint8_t channel, const uint8_t *data, size_t length);
+void captureClose(struct capture *cap);
+
+// Reading back, returns 1 at the end of the file or on a truncated record.
+// data must hold 65535 bytes.
+int captureOpenRead(struct capture *cap, const char *path);
+int captureRead(struct capture *cap, struct captureRecord *rec, uint8_t *data);
+
+#endif
@@ -0,0 +1,115 @@
+// Full screen status of every monitor, decoded from the status words
+// (2022) Martin Hejnfelt (martin@hejnfelt.com)
+// See https://immerhax.com/?p=797 for more information
+// Licensed under the WTFPL, see LICENSE.txt
+
+#include <stdio.h>
+#include <string.h>
+
+#include "bkm15r.h"
+#include "dashboard.h"
+
+#define FLAG_COLUMNS    (7)
+#define FLAG_WIDTH      (11)
+#define FLAG_ROWS       ((STATUS_BUTTON_COUNT + FLAG_COLUMNS - 1) / FLAG_COLUMNS)
+// Title, knobs, message and a blank line on top, the keys at the bottom
+#define TOP_ROWS        (4)
+#define BOTTOM_ROWS     (2)
+
+// Column headings for the compact layout, same order as statusButtons
+static const char *flagCodes[STATUS_BUTTON_COUNT] = {
+    "PW", "SC", "HD", "VD", "MO", "CM", "MK", "ES", "AP", "CU", "AS",
+    "CT", "CB", "BO", "RC", "GC", "BC", "MP", "MC", "MB", "MN"
+};
+
+static const char *monitorState(const struct monitor *m) {
+    if(m->fd < 0) return m->reconnect ? "reconnecting" : "closed";
+    if(m->connecting) return "connecting";
+    if(!m->statusValid) return "waiting";
+    if(!(m->status[0] & POWER_ON_STATUS)) return "powered off";
+    return "on";
+}
+
+static uint8_t flagSet(const struct monitor *m, unsigned flag) {
+    return m->statusValid && (m->status[statusButtons[flag].word] & statusButtons[flag].mask);
+}
+
+static void drawKnobs(struct screen *s, int row, const struct dashboardState *state) {
+    int col, k;
+
+    col = screenText(s, row, 0, ATTR_BOLD, "Knob: ");
+    if(state->knobSelect) {
+        screenText(s, row, col, ATTR_REVERSE, "P(H)ASE CH(R)OMA BR(I)GHT CO(N)TRAST");
+        return;
+    }
+    for(k = 0; k < KNOB_NONE; ++k) {
+        col = screenText(s, row, col, k == state->knob ? ATTR_REVERSE : ATTR_NORMAL, " %s ", knobNames[k]);
+        col = screenText(s, row, col, ATTR_NORMAL, " ");
+    }
+}
+
+static void drawMonitor(struct screen *s, int row, const struct monitor *m) {
+    unsigned flag;
+    int col;
+
+    col = screenText(s, row, 0, ATTR_BOLD, "[%s]", m->name);
+    col = screenText(s, row, col, ATTR_NORMAL, " %s", monitorState(m));
+    if(m->statusValid) {
+        screenText(s, row, col, ATTR_NORMAL, "  %.04X %.04X %.04X %.04X %.04X",
+            m->status[0],m->status[1],m->status[2],m->status[3],m->status[4]);
+    }
+    for(flag = 0; flag < STATUS_BUTTON_COUNT; ++flag) {
+        screenText(s, row + 1 + flag / FLAG_COLUMNS, 2 + (flag % FLAG_COLUMNS) * FLAG_WIDTH,
+            flagSet(m, flag) ? ATTR_REVERSE : ATTR_NORMAL, "%-*s", FLAG_WIDTH - 1, statusButtons[flag].name);
+    }
+}
+
+static void drawCompact(struct screen *s, int row, const struct monitor *m) {
+    unsigned flag;
+    int col;
+
+    screenText(s, row, 0, ATTR_NORMAL, "%-21.21s %-12s", m->name, monitorState(m));
+    for(flag = 0, col = 35; flag < STATUS_BUTTON_COUNT; ++flag, col += 3) {
+        if(flagSet(m, flag)) {
+            screenText(s, row, col, ATTR_REVERSE, "%s", flagCodes[flag]);
+        } else {
+            screenText(s, row, col, ATTR_NORMAL, " .");
+        }
+    }
+}
+
+void drawDashboard(struct screen *s, const struct monitor *mons, int count, const struct dashboardState *state) {
+    int i, row, rows, connected = 0, shown;
+    unsigned flag;
+
+    for(i = 0; i < count; ++i) {
+        if(mons[i].fd >= 0 && !mons[i].connecting) connected++;
+    }
+
+    screenClear(s);
+    screenText(s, 0, 0, ATTR_BOLD, "Sony BKM-15R emulator - %d/%d connected", connected, count);
+    drawKnobs(s, 1, state);
+    if(state->message != NULL) screenText(s, 2, 0, ATTR_NORMAL, "%s", state->message);
+
+    rows = s->rows - TOP_ROWS - BOTTOM_ROWS;
+    row = TOP_ROWS;
+    if(count * (1 + (int)FLAG_ROWS + 1) <= rows) {
+        for(i = 0; i < count; ++i, row += 1 + FLAG_ROWS + 1) drawMonitor(s, row, &mons[i]);
+        shown = count;
+    } else {
+        screenText(s, row, 0, ATTR_BOLD, "%-21s %-12s", "Monitor", "State");
+        for(flag = 0; flag < STATUS_BUTTON_COUNT; ++flag) {
+            screenText(s, row, 35 + flag * 3, ATTR_BOLD, "%s", flagCodes[flag]);
+        }
+        // leaving a line to say how many didn't fit
+        shown = count <= rows - 1 ? count : rows - 2;
+        if(shown < 0) shown = 0;
+        for(i = 0; i < shown; ++i) drawCompact(s, ++row, &mons[i]);
+    }
+    if(shown < count) {
+        screenText(s, s->rows - BOTTOM_ROWS - 1, 0, ATTR_NORMAL, "... %d more not shown", count - shown);
+    }
+
+    screenText(s, s->rows - 1, 0, ATTR_NORMAL,
+        "P power  D degauss  k knob  +/- turn  m menu  ^L repaint  q quit");
+}
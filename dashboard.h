@@ -0,0 +1,23 @@
+// Full screen status of every monitor, decoded from the status words
+// (2022) Martin Hejnfelt (martin@hejnfelt.com)
+// See https://immerhax.com/?p=797 for more information
+// Licensed under the WTFPL, see LICENSE.txt
+
+#ifndef DASHBOARD_H
+#define DASHBOARD_H
+
+#include "monitor.h"
+#include "screen.h"
+
+struct dashboardState {
+    int knob;               // enum Knobs, KNOB_NONE if none is active
+    uint8_t knobSelect;     // waiting for a knob to be picked
+    const char *message;    // last event worth showing, may be NULL
+};
+
+// Draws into the back buffer only, screenFlush puts it on the terminal.
+// Each monitor gets its flags spelled out while they fit on the screen,
+// otherwise it's a line per monitor with a column per flag.
+void drawDashboard(struct screen *s, const struct monitor *mons, int count, const struct dashboardState *state);
+
+#endif
@@ -0,0 +1,231 @@
+// Finds monitors on the network by scanning an address range
+// (2022) Martin Hejnfelt (martin@hejnfelt.com)
+// See https://immerhax.com/?p=797 for more information
+// Licensed under the WTFPL, see LICENSE.txt
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/resource.h>
+
+#include "bkm15r.h"
+#include "monitor.h"
+#include "discover.h"
+
+// Left for stdio, the terminal and whatever else the app has open
+#define DISCOVER_SPARE_FDS  (32)
+
+struct probe {
+    struct monitor mon;
+    uint32_t address;   // host byte order
+    uint8_t busy;
+    uint8_t done;
+    uint8_t other;      // answered with something that isn't a monitor's reply
+};
+
+struct found {
+    uint32_t address;
+    uint16_t status[STATUS_WORDS];
+};
+
+static struct found *found = NULL;
+static unsigned foundCount = 0, foundCapacity = 0, otherCount = 0;
+
+static void onStatus(struct monitor *mon) {
+    struct probe *p = mon->user;
+    struct found *grown;
+    unsigned capacity;
+
+    p->done = 1;
+    if(foundCount == foundCapacity) {
+        capacity = foundCapacity ? foundCapacity * 2 : 16;
+        grown = realloc(found, capacity * sizeof(struct found));
+        if(grown == NULL) {
+            fprintf(stderr,"Out of memory, %s not listed\n",mon->name);
+            return;
+        }
+        found = grown;
+        foundCapacity = capacity;
+    }
+    found[foundCount].address = p->address;
+    memcpy(found[foundCount].status, mon->status, sizeof(mon->status));
+    foundCount++;
+}
+
+// Timed out or answered with something other than a status, not a monitor
+static void onComplete(struct monitor *mon, const struct request *req, int result) {
+    struct probe *p = mon->user;
+    (void)req;
+    if(result != REQUEST_OK) p->done = 1;
+}
+
+// Whatever else listens on the port answers with data the engine can't
+// make out, that's counted rather than printed in the middle of the scan
+static void onMessage(struct monitor *mon, const char *text) {
+    struct probe *p = mon->user;
+    (void)text;
+    if(!p->other) otherCount++;
+    p->other = 1;
+    p->done = 1;
+}
+
+static int parseAddress(const char *text, uint32_t *address) {
+    struct in_addr in;
+    if(inet_aton(text, &in) == 0) return 1;
+    *address = ntohl(in.s_addr);
+    return 0;
+}
+
+// Fills in the first and last address to try, both in host byte order
+static int parseRange(const char *range, uint32_t *first, uint32_t *last, int *port) {
+    char spec[64], *sep, *end;
+    long bits;
+
+    if(strlen(range) >= sizeof(spec)) return 1;
+    strcpy(spec, range);
+    *port = MONITOR_PORT;
+    sep = strrchr(spec, ':');
+    if(sep != NULL) {
+        *sep++ = 0;
+        *port = atoi(sep);
+    }
+
+    if((sep = strchr(spec, '/')) != NULL) {
+        *sep++ = 0;
+        bits = strtol(sep, &end, 10);
+        if(*end || bits < 16 || bits > 32 || parseAddress(spec, first)) return 1;
+        *first &= bits ? ~0U << (32 - bits) : 0;
+        *last = *first | (bits < 32 ? ~0U >> bits : 0);
+        // the network and broadcast addresses aren't hosts
+        if(bits <= 30) {
+            (*first)++;
+            (*last)--;
+        }
+        return 0;
+    }
+    if((sep = strchr(spec, '-')) != NULL) {
+        *sep++ = 0;
+        if(parseAddress(spec, first)) return 1;
+        if(strchr(sep, '.') != NULL) return parseAddress(sep, last);
+        bits = strtol(sep, &end, 10);
+        if(*end || bits < 0 || bits > 255) return 1;
+        *last = (*first & ~0xFFU) | bits;
+        return 0;
+    }
+    if(parseAddress(spec, first)) return 1;
+    *last = *first;
+    return 0;
+}
+
+static int startProbe(struct probe *p, uint32_t address, int port, int timeoutMs) {
+    struct in_addr in;
+    char ip[INET_ADDRSTRLEN];
+
+    in.s_addr = htonl(address);
+    inet_ntop(AF_INET, &in, ip, sizeof(ip));
+    monitorInit(&p->mon);
+    p->mon.connectTimeoutMs = timeoutMs;
+    p->mon.timeoutMs = timeoutMs;
+    p->mon.user = p;
+    p->mon.onStatus = onStatus;
+    p->mon.onComplete = onComplete;
+    p->mon.onMessage = onMessage;
+    p->address = address;
+    p->done = 0;
+    p->other = 0;
+    // unreachable right away (no route) is as good as done
+    if(monitorStartConnect(&p->mon, ip, port)) return 1;
+    monitorRequestStatus(&p->mon);
+    p->busy = 1;
+    return 0;
+}
+
+static int compareFound(const void *a, const void *b) {
+    uint32_t x = ((const struct found*)a)->address, y = ((const struct found*)b)->address;
+    return (x > y) - (x < y);
+}
+
+int runDiscovery(const char *range, int concurrency, int timeoutMs) {
+    struct probe *probes;
+    struct pollfd *fds;
+    struct rlimit limit;
+    struct in_addr in;
+    uint32_t first, last;
+    uint64_t next, start, addresses;
+    int port, i, active = 0, timeout, t;
+    unsigned f;
+
+    if(parseRange(range, &first, &last, &port) || last < first) {
+        fprintf(stderr,"Could not make out the range %s, give a.b.c.d/16 to /32, a.b.c.d-e or a.b.c.d-a.b.c.e\n",range);
+        return 1;
+    }
+    addresses = (uint64_t)last - first + 1;
+    if(addresses > DISCOVER_MAX_ADDRESSES) {
+        fprintf(stderr,"At most %d addresses at a time\n",DISCOVER_MAX_ADDRESSES);
+        return 1;
+    }
+    // every connect in flight is a socket
+    if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY &&
+        (rlim_t)concurrency + DISCOVER_SPARE_FDS > limit.rlim_cur)
+    {
+        concurrency = limit.rlim_cur > DISCOVER_SPARE_FDS ? limit.rlim_cur - DISCOVER_SPARE_FDS : 1;
+    }
+    if((uint64_t)concurrency > addresses) concurrency = addresses;
+    if(concurrency < 1) concurrency = 1;
+
+    probes = calloc(concurrency, sizeof(struct probe));
+    fds = calloc(concurrency, sizeof(struct pollfd));
+    if(probes == NULL || fds == NULL) {
+        free(probes);
+        free(fds);
+        return 1;
+    }
+
+    fprintf(stdout,"Scanning %llu address(es) on port %d, %d at a time\n",(unsigned long long)addresses,port,concurrency);
+    start = monitorNow();
+    next = first;
+    for(;;) {
+        timeout = -1;
+        active = 0;
+        for(i = 0; i < concurrency; ++i) {
+            while(!probes[i].busy && next <= last) startProbe(&probes[i], next++, port, timeoutMs);
+            fds[i].fd = -1;
+            if(!probes[i].busy) continue;
+            active++;
+            fds[i].fd = probes[i].mon.fd;
+            fds[i].events = monitorPollEvents(&probes[i].mon);
+            t = monitorPollTimeout(&probes[i].mon);
+            if(t >= 0 && (timeout < 0 || t < timeout)) timeout = t;
+        }
+        if(active == 0) break;
+        if(poll(fds, concurrency, timeout) < 0 && errno != EINTR) break;
+        for(i = 0; i < concurrency; ++i) {
+            if(!probes[i].busy) continue;
+            if(monitorHandleEvents(&probes[i].mon, fds[i].revents) || probes[i].done) {
+                monitorClose(&probes[i].mon);
+                probes[i].busy = 0;
+            }
+        }
+    }
+
+    qsort(found, foundCount, sizeof(struct found), compareFound);
+    for(f = 0; f < foundCount; ++f) {
+        in.s_addr = htonl(found[f].address);
+        fprintf(stdout,"%s:%d %s %.04X %.04X %.04X %.04X %.04X\n",inet_ntoa(in),port,
+            (found[f].status[0] & POWER_ON_STATUS) ? "on" : "powered off",
+            found[f].status[0],found[f].status[1],found[f].status[2],found[f].status[3],found[f].status[4]);
+    }
+    fprintf(stdout,"Found %u monitor(s) in %.0f ms\n",foundCount,(monitorNow() - start) / 1e6);
+    if(otherCount) fprintf(stdout,"%u other host(s) answered on the port but aren't monitors\n",otherCount);
+
+    free(probes);
+    free(fds);
+    free(found);
+    found = NULL;
+    f = foundCount;
+    foundCount = foundCapacity = otherCount = 0;
+    return f == 0;
+}
@@ -0,0 +1,23 @@
+// Finds monitors on the network by scanning an address range
+// (2022) Martin Hejnfelt (martin@hejnfelt.com)
+// See https://immerhax.com/?p=797 for more information
+// Licensed under the WTFPL, see LICENSE.txt
+
+#ifndef DISCOVER_H
+#define DISCOVER_H
+
+#include <stdint.h>
+
+#define DISCOVER_DEFAULT_CONCURRENCY    (256)
+#define DISCOVER_DEFAULT_TIMEOUT_MS     (500)
+#define DISCOVER_MAX_ADDRESSES          (65536)
+
+// Scans "a.b.c.d/n", "a.b.c.d-e", "a.b.c.d-a.b.c.e" or a single address,
+// each with an optional ":port", keeping up to concurrency non-blocking
+// connects going. Whatever accepts is sent STATget and only counts as a
+// monitor if a status reply comes back; timeoutMs goes for the connect and
+// the reply each. Monitors are printed in address order with their power
+// state. Returns 0 if any was found.
+int runDiscovery(const char *range, int concurrency, int timeoutMs);
+
+#endif
@@ -0,0 +1,163 @@
+// Rotary encoders and jog wheels as knobs, read from Linux evdev devices
+// (2022) Martin Hejnfelt (martin@hejnfelt.com)
+// See https://immerhax.com/?p=797 for more information
+// Licensed under the WTFPL, see LICENSE.txt
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
+
+#include "encoder.h"
+
+// Enough for a fast spin to be picked up in one go
+#define ENCODER_READ_EVENTS (64)
+
+struct axisName {
+    const char *name;
+    uint16_t code;
+};
+
+static const struct axisName axisNames[] = {
+    { "DIAL",   REL_DIAL },
+    { "WHEEL",  REL_WHEEL },
+    { "HWHEEL", REL_HWHEEL },
+    { "X",      REL_X },
+    { "Y",      REL_Y }
+};
+
+#define AXIS_NAME_COUNT (sizeof(axisNames)/sizeof(axisNames[0]))
+
+static int addAxis(struct encoder *enc, const char *name, int knob) {
+    unsigned i;
+
+    if(enc->axisCount == ENCODER_MAX_AXES) {
+        fprintf(stderr,"At most %d axes per encoder\n",ENCODER_MAX_AXES);
+        return 1;
+    }
+    for(i = 0; i < AXIS_NAME_COUNT; ++i) {
+        if(!strcasecmp(axisNames[i].name, name)) break;
+    }
+    if(i == AXIS_NAME_COUNT) {
+        fprintf(stderr,"Unknown encoder axis %s\n",name);
+        return 1;
+    }
+    enc->axes[enc->axisCount].code = axisNames[i].code;
+    enc->axes[enc->axisCount].knob = knob;
+    enc->axisCount++;
+    return 0;
+}
+
+static int parseAxes(struct encoder *enc, char *list) {
+    char *axis, *knob, *save = NULL;
+    int k;
+
+    for(axis = strtok_r(list, ",", &save); axis != NULL; axis = strtok_r(NULL, ",", &save)) {
+        k = KNOB_NONE;
+        knob = strchr(axis, '=');
+        if(knob != NULL) {
+            *knob++ = 0;
+            k = knobByName(knob);
+            if(k == KNOB_NONE) {
+                fprintf(stderr,"Unknown knob %s\n",knob);
+                return 1;
+            }
+        }
+        if(addAxis(enc, axis, k)) return 1;
+    }
+    return 0;
+}
+
+int encoderOpen(struct encoder *enc, const char *spec) {
+    char axes[128];
+    const char *colon = strchr(spec, ':');
+    size_t len = colon ? (size_t)(colon - spec) : strlen(spec);
+
+    memset(enc, 0, sizeof(*enc));
+    enc->fd = -1;
+    if(len >= sizeof(enc->path) || (colon && strlen(colon + 1) >= sizeof(axes))) {
+        fprintf(stderr,"Encoder spec too long: %s\n",spec);
+        return 1;
+    }
+    memcpy(enc->path, spec, len);
+    enc->path[len] = 0;
+    if(colon) {
+        strcpy(axes, colon + 1);
+        if(parseAxes(enc, axes)) return 1;
+    } else {
+        addAxis(enc, "DIAL", KNOB_NONE);
+        addAxis(enc, "WHEEL", KNOB_NONE);
+    }
+
+    enc->fd = open(enc->path, O_RDONLY | O_NONBLOCK);
+    if(enc->fd < 0) {
+        fprintf(stderr,"Could not open encoder %s: %s\n",enc->path,strerror(errno));
+        return 1;
+    }
+    // Keeps a jog wheel that is also a mouse from scrolling the desktop.
+    // Not an input device at all (a pipe when testing) is fine too.
+    if(ioctl(enc->fd, EVIOCGRAB, 1) < 0 && errno != ENOTTY && errno != EINVAL) {
+        fprintf(stderr,"Could not grab encoder %s: %s\n",enc->path,strerror(errno));
+        encoderClose(enc);
+        return 1;
+    }
+    return 0;
+}
+
+static void handleEvent(struct encoder *enc, const struct input_event *ev, int ticks[KNOB_NONE + 1]) {
+    int i;
+
+    if(ev->type == EV_SYN) {
+        if(ev->code == SYN_DROPPED) {
+            // the frame is incomplete, and so is the one up to the next report
+            enc->dropped = 1;
+            memset(enc->pending, 0, sizeof(enc->pending));
+        } else if(ev->code == SYN_REPORT) {
+            if(!enc->dropped) {
+                for(i = 0; i <= KNOB_NONE; ++i) ticks[i] += enc->pending[i];
+            }
+            enc->dropped = 0;
+            memset(enc->pending, 0, sizeof(enc->pending));
+        }
+        return;
+    }
+    if(ev->type != EV_REL) return;
+    for(i = 0; i < enc->axisCount; ++i) {
+        if(enc->axes[i].code == ev->code) {
+            enc->pending[enc->axes[i].knob] += ev->value;
+            return;
+        }
+    }
+}
+
+int encoderRead(struct encoder *enc, int ticks[KNOB_NONE + 1]) {
+    struct input_event events[ENCODER_READ_EVENTS];
+    ssize_t n, i;
+
+    if(enc->fd < 0) return 1;
+    for(;;) {
+        n = read(enc->fd, events, sizeof(events));
+        if(n < 0) {
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN) return 0;
+            return 1;
+        }
+        // end of file on a pipe, the device being unplugged gives ENODEV
+        if(n == 0) return 1;
+        for(i = 0; i < n / (ssize_t)sizeof(struct input_event); ++i) {
+            handleEvent(enc, &events[i], ticks);
+        }
+        if(n < (ssize_t)sizeof(events)) return 0;
+    }
+}
+
+void encoderClose(struct encoder *enc) {
+    if(enc->fd < 0) return;
+    close(enc->fd);
+    enc->fd = -1;
+}
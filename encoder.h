@@ -0,0 +1,41 @@
+// Rotary encoders and jog wheels as knobs, read from Linux evdev devices
+// (2022) Martin Hejnfelt (martin@hejnfelt.com)
+// See https://immerhax.com/?p=797 for more information
+// Licensed under the WTFPL, see LICENSE.txt
+
+#ifndef ENCODER_H
+#define ENCODER_H
+
+#include <stdint.h>
+
+#include "protocol.h"
+
+#define ENCODER_MAX_AXES    (4)
+
+struct encoderAxis {
+    uint16_t code;  // REL_DIAL, REL_WHEEL, ...
+    int knob;       // enum Knobs, KNOB_NONE for whichever knob is selected
+};
+
+struct encoder {
+    int fd;
+    char path[64];
+    struct encoderAxis axes[ENCODER_MAX_AXES];
+    int axisCount;
+    int pending[KNOB_NONE + 1];    // detents of the event frame being read
+    uint8_t dropped;            // the kernel lost events, skip to the next frame
+};
+
+// Takes "device" or "device:AXIS[=KNOB],...", e.g.
+// /dev/input/event5:DIAL=PHASE,WHEEL=BRIGHT. Axes are DIAL, WHEEL, HWHEEL,
+// X and Y, knobs are named as in protocol.h, an axis without one turns the
+// selected knob. Without axes DIAL and WHEEL turn the selected knob.
+// Returns 0 on success.
+int encoderOpen(struct encoder *enc, const char *spec);
+// Reads all the device has, adding the detents of every complete event frame
+// to ticks, indexed by knob with KNOB_NONE for the selected one.
+// Returns 1 once the device is gone.
+int encoderRead(struct encoder *enc, int ticks[KNOB_NONE + 1]);
+void encoderClose(struct encoder *enc);
+
+#endif
@@ -0,0 +1,129 @@
+// Virtual rotary encoder, a uinput device spinning a dial for testing
+// (2022) Martin Hejnfelt (martin@hejnfelt.com)
+// See https://immerhax.com/?p=797 for more information
+// Licensed under the WTFPL, see LICENSE.txt
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
+#include <linux/uinput.h>
+
+#define SIM_DEFAULT_DETENTS (96)
+#define SIM_DEFAULT_RATE    (1000)
+
+static int emit(int fd, uint16_t type, uint16_t code, int32_t value) {
+    struct input_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.type = type;
+    ev.code = code;
+    ev.value = value;
+    return write(fd, &ev, sizeof(ev)) != sizeof(ev);
+}
+
+static int createDevice(void) {
+    struct uinput_setup setup;
+    int fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+
+    if(fd < 0) {
+        fprintf(stderr,"Could not open /dev/uinput: %s\n",strerror(errno));
+        return -1;
+    }
+    if(ioctl(fd, UI_SET_EVBIT, EV_REL) < 0 ||
+        ioctl(fd, UI_SET_RELBIT, REL_DIAL) < 0 ||
+        ioctl(fd, UI_SET_RELBIT, REL_WHEEL) < 0)
+    {
+        fprintf(stderr,"Could not set up the device: %s\n",strerror(errno));
+        close(fd);
+        return -1;
+    }
+    memset(&setup, 0, sizeof(setup));
+    setup.id.bustype = BUS_VIRTUAL;
+    setup.id.vendor = 0x054c;   // Sony
+    setup.id.product = 0x0015;
+    strcpy(setup.name, "BKM-15R virtual encoder");
+    if(ioctl(fd, UI_DEV_SETUP, &setup) < 0 || ioctl(fd, UI_DEV_CREATE) < 0) {
+        fprintf(stderr,"Could not create the device: %s\n",strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int main(int argc, char *argv[])
+{
+    struct timespec interval;
+    const char *outPath = NULL;
+    int detents = SIM_DEFAULT_DETENTS, rate = SIM_DEFAULT_RATE, delay = 1000;
+    int code = REL_DIAL, step = 1;
+    int opt, fd, i, rc = 0;
+
+    while((opt = getopt(argc, argv, "n:r:s:wbo:")) != -1) {
+        switch(opt) {
+            case 'n':
+                detents = atoi(optarg);
+            break;
+            case 'r':
+                rate = atoi(optarg);
+            break;
+            case 's':
+                delay = atoi(optarg);
+            break;
+            case 'w':
+                code = REL_WHEEL;
+            break;
+            case 'b':
+                step = -1;
+            break;
+            case 'o':
+                outPath = optarg;
+            break;
+            default:
+                fprintf(stderr,"Usage: %s [-n detents] [-r detents per second] [-s start delay ms] [-w wheel instead of dial] [-b backwards] [-o write events to a file or fifo instead]\n",argv[0]);
+                return 1;
+        }
+    }
+    if(rate < 1) rate = 1;
+
+    if(outPath != NULL) {
+        fd = open(outPath, O_WRONLY);
+        if(fd < 0) {
+            fprintf(stderr,"Could not open %s: %s\n",outPath,strerror(errno));
+            return 1;
+        }
+    } else {
+        fd = createDevice();
+        if(fd < 0) return 1;
+        fprintf(stdout,"Created virtual encoder, see /proc/bus/input/devices for its event node\n");
+        fflush(stdout);
+    }
+
+    // time for whoever is testing to open the device
+    usleep(delay * 1000);
+    interval.tv_sec = 0;
+    interval.tv_nsec = 1000000000L / rate;
+    for(i = 0; i < detents; ++i) {
+        if(emit(fd, EV_REL, code, step) || emit(fd, EV_SYN, SYN_REPORT, 0)) {
+            fprintf(stderr,"Write failed after %d detents: %s\n",i,strerror(errno));
+            rc = 1;
+            break;
+        }
+        nanosleep(&interval, NULL);
+    }
+    if(rc == 0) fprintf(stdout,"Sent %d detents\n",detents * step);
+
+    if(outPath == NULL) {
+        // give readers a moment to drain before the device goes away
+        usleep(200 * 1000);
+        ioctl(fd, UI_DEV_DESTROY);
+    }
+    close(fd);
+    return rc;
+}
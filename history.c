@@ -0,0 +1,165 @@
+// Status history, every change of the status words in a fixed size ring file
+// (2022) Martin Hejnfelt (martin@hejnfelt.com)
+// See https://immerhax.com/?p=797 for more information
+// Licensed under the WTFPL, see LICENSE.txt
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "history.h"
+
+static size_t historySize(unsigned records) {
+    return sizeof(struct historyHeader) + (size_t)records * sizeof(struct historyRecord);
+}
+
+static int mapHistory(struct history *h, int prot) {
+    void *map = mmap(NULL, h->size, prot, MAP_SHARED, h->fd, 0);
+    if(map == MAP_FAILED) return 1;
+    h->hdr = map;
+    h->records = (struct historyRecord*)(h->hdr + 1);
+    return 0;
+}
+
+int historyOpen(struct history *h, const char *path, unsigned records) {
+    struct historyRecord *rec;
+    struct stat st;
+    uint64_t i, first;
+
+    memset(h, 0, sizeof(*h));
+    if(records == 0) records = HISTORY_DEFAULT_RECORDS;
+    h->size = historySize(records);
+    h->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if(h->fd < 0 || fstat(h->fd, &st) < 0) {
+        fprintf(stderr,"Could not open history %s\n",path);
+        goto fail;
+    }
+    if((size_t)st.st_size != h->size && (ftruncate(h->fd, 0) < 0 || ftruncate(h->fd, h->size) < 0)) {
+        fprintf(stderr,"Could not size history %s\n",path);
+        goto fail;
+    }
+    if(mapHistory(h, PROT_READ | PROT_WRITE)) {
+        fprintf(stderr,"Could not map history %s\n",path);
+        goto fail;
+    }
+
+    if(memcmp(h->hdr->magic, HISTORY_MAGIC, HISTORY_MAGIC_SIZE) || h->hdr->capacity != records ||
+        h->hdr->monitors > HISTORY_MAX_MONITORS)
+    {
+        if(st.st_size > 0) fprintf(stderr,"Starting a new history in %s\n",path);
+        memset(h->hdr, 0, h->size);
+        memcpy(h->hdr->magic, HISTORY_MAGIC, HISTORY_MAGIC_SIZE);
+        h->hdr->capacity = records;
+        return 0;
+    }
+
+    // carrying on, a monitor's first status only goes in if it changed
+    first = h->hdr->written > records ? h->hdr->written - records : 0;
+    for(i = first; i < h->hdr->written; ++i) {
+        rec = &h->records[i % records];
+        if(rec->monitor >= HISTORY_MAX_MONITORS) continue;
+        memcpy(h->last[rec->monitor], rec->status, sizeof(rec->status));
+        h->lastValid |= 1ULL << rec->monitor;
+    }
+    return 0;
+
+fail:
+    historyClose(h);
+    return 1;
+}
+
+uint8_t historyMonitor(struct history *h, const char *name) {
+    uint32_t i;
+
+    if(h->hdr == NULL) return HISTORY_UNKNOWN;
+    for(i = 0; i < h->hdr->monitors; ++i) {
+        if(!strncmp(h->hdr->names[i], name, HISTORY_NAME_SIZE - 1)) return i;
+    }
+    if(h->hdr->monitors == HISTORY_MAX_MONITORS) return HISTORY_UNKNOWN;
+    snprintf(h->hdr->names[i], HISTORY_NAME_SIZE, "%s", name);
+    h->hdr->monitors++;
+    return i;
+}
+
+void historyAppend(struct history *h, uint8_t monitor, const uint16_t *status) {
+    struct historyRecord *rec;
+    struct timespec ts;
+    uint64_t written;
+
+    if(h == NULL || h->hdr == NULL || monitor >= HISTORY_MAX_MONITORS) return;
+    if((h->lastValid & (1ULL << monitor)) && !memcmp(h->last[monitor], status, sizeof(h->last[monitor]))) return;
+    memcpy(h->last[monitor], status, sizeof(h->last[monitor]));
+    h->lastValid |= 1ULL << monitor;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    written = h->hdr->written;
+    rec = &h->records[written % h->hdr->capacity];
+    rec->sec = ts.tv_sec;
+    rec->centis = ts.tv_nsec / 10000000;
+    rec->monitor = monitor;
+    memcpy(rec->status, status, sizeof(rec->status));
+    // a reader never sees the count before the record it counts
+    __atomic_store_n(&h->hdr->written, written + 1, __ATOMIC_RELEASE);
+}
+
+void historyClose(struct history *h) {
+    if(h->hdr != NULL) munmap(h->hdr, h->size);
+    if(h->fd >= 0) close(h->fd);
+    h->hdr = NULL;
+    h->records = NULL;
+    h->fd = -1;
+}
+
+int historyOpenRead(struct history *h, const char *path) {
+    struct historyHeader hdr;
+    struct stat st;
+
+    memset(h, 0, sizeof(*h));
+    h->fd = open(path, O_RDONLY);
+    if(h->fd < 0 || fstat(h->fd, &st) < 0) {
+        fprintf(stderr,"Could not open history %s\n",path);
+        goto fail;
+    }
+    if(pread(h->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+        memcmp(hdr.magic, HISTORY_MAGIC, HISTORY_MAGIC_SIZE) || hdr.capacity == 0 ||
+        (size_t)st.st_size != historySize(hdr.capacity))
+    {
+        fprintf(stderr,"%s is not a history\n",path);
+        goto fail;
+    }
+    h->size = st.st_size;
+    if(mapHistory(h, PROT_READ)) {
+        fprintf(stderr,"Could not map history %s\n",path);
+        goto fail;
+    }
+    return 0;
+
+fail:
+    historyClose(h);
+    return 1;
+}
+
+unsigned historyCopy(const struct history *h, struct historyRecord *out) {
+    uint32_t capacity = h->hdr->capacity;
+    uint64_t written, after, first, i, skip;
+    unsigned count;
+
+    written = __atomic_load_n(&h->hdr->written, __ATOMIC_ACQUIRE);
+    first = written > capacity ? written - capacity : 0;
+    for(i = first; i < written; ++i) out[i - first] = h->records[i % capacity];
+    count = written - first;
+
+    // the oldest ones may have been written over while copying
+    after = __atomic_load_n(&h->hdr->written, __ATOMIC_ACQUIRE);
+    if(after > first + capacity) {
+        skip = after - capacity - first;
+        if(skip >= count) return 0;
+        memmove(out, out + skip, (count - skip) * sizeof(*out));
+        count -= skip;
+    }
+    return count;
+}
@@ -0,0 +1,66 @@
+// Status history, every change of the status words in a fixed size ring file
+// (2022) Martin Hejnfelt (martin@hejnfelt.com)
+// See https://immerhax.com/?p=797 for more information
+// Licensed under the WTFPL, see LICENSE.txt
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "bkm15r.h"
+
+// The file is a struct historyHeader followed by capacity records and is
+// written through a shared mapping, so appending is a store into memory.
+// Fields are in host byte order.
+#define HISTORY_MAGIC           "BKMHIST1"
+#define HISTORY_MAGIC_SIZE      (8)
+#define HISTORY_MAX_MONITORS    (64)
+#define HISTORY_NAME_SIZE       (32)
+#define HISTORY_UNKNOWN         (0xFF)
+#define HISTORY_DEFAULT_RECORDS (1024)
+
+struct historyHeader {
+    char magic[HISTORY_MAGIC_SIZE];
+    uint32_t capacity;      // records in the ring
+    uint32_t monitors;      // names in use
+    uint64_t written;       // records ever appended, the next one goes at written % capacity
+    char names[HISTORY_MAX_MONITORS][HISTORY_NAME_SIZE];
+};
+
+// 16 bytes, wall clock time to 10ms
+struct historyRecord {
+    uint32_t sec;           // CLOCK_REALTIME
+    uint16_t status[STATUS_WORDS];
+    uint8_t monitor;        // index into names
+    uint8_t centis;
+};
+
+struct history {
+    int fd;
+    size_t size;
+    struct historyHeader *hdr;
+    struct historyRecord *records;
+    // what was last appended per monitor, so only changes go in
+    uint16_t last[HISTORY_MAX_MONITORS][STATUS_WORDS];
+    uint64_t lastValid;
+};
+
+// Opens or creates the file for appending. An existing history with the
+// same number of records is carried on, anything else starts afresh.
+int historyOpen(struct history *h, const char *path, unsigned records);
+// The index a monitor's records go under, HISTORY_UNKNOWN once the names
+// are all taken
+uint8_t historyMonitor(struct history *h, const char *name);
+// Appends status unless it's what the monitor had last time
+void historyAppend(struct history *h, uint8_t monitor, const uint16_t *status);
+void historyClose(struct history *h);
+
+// Read only access, while another process may be appending
+int historyOpenRead(struct history *h, const char *path);
+// Copies the records still in the ring, oldest first, into out, which must
+// hold capacity of them. Returns how many there are.
+unsigned historyCopy(const struct history *h, struct historyRecord *out);
+
+#endif
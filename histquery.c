@@ -0,0 +1,171 @@
+// Prints the status changes kept in a history file
+// (2022) Martin Hejnfelt (martin@hejnfelt.com)
+// See https://immerhax.com/?p=797 for more information
+// Licensed under the WTFPL, see LICENSE.txt
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "bkm15r.h"
+#include "history.h"
+
+#define ALL_FLAGS   (STATUS_BUTTON_COUNT)
+
+// Takes -30s, -15m, -2h and -1d back from now, @epoch seconds, and local
+// "YYYY-MM-DD HH:MM:SS" with the time or its seconds left out, or just
+// "HH:MM[:SS]" for today. Returns 1 if it's none of them.
+static int parseTime(const char *text, time_t *out) {
+    static const char *formats[] = { "%Y-%m-%d %H:%M:%S", "%Y-%m-%d %H:%M", "%Y-%m-%d", "%H:%M:%S", "%H:%M" };
+    time_t now = time(NULL);
+    struct tm tm;
+    const char *end;
+    char *unit;
+    long value;
+    unsigned i;
+
+    if(text[0] == '-') {
+        value = strtol(text + 1, &unit, 10);
+        if(unit == text + 1) return 1;
+        switch(*unit) {
+            case 0:
+            case 's': *out = now - value; return 0;
+            case 'm': *out = now - value * 60; return 0;
+            case 'h': *out = now - value * 3600; return 0;
+            case 'd': *out = now - value * 86400; return 0;
+            default: return 1;
+        }
+    }
+    if(text[0] == '@') {
+        value = strtol(text + 1, &unit, 10);
+        if(*unit) return 1;
+        *out = value;
+        return 0;
+    }
+    for(i = 0; i < sizeof(formats)/sizeof(formats[0]); ++i) {
+        localtime_r(&now, &tm);
+        tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+        end = strptime(text, formats[i], &tm);
+        if(end == NULL || *end) continue;
+        tm.tm_isdst = -1;
+        *out = mktime(&tm);
+        return 0;
+    }
+    return 1;
+}
+
+static void printWhen(const struct historyRecord *rec, const char *name) {
+    time_t sec = rec->sec;
+    struct tm tm;
+    char when[32];
+
+    localtime_r(&sec, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+    fprintf(stdout,"%s.%02u [%s]",when,rec->centis,name);
+}
+
+static uint8_t flagSet(const uint16_t *status, unsigned flag) {
+    return (status[statusButtons[flag].word] & statusButtons[flag].mask) != 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct history h;
+    struct historyRecord *records;
+    const struct historyRecord *rec;
+    uint16_t previous[HISTORY_MAX_MONITORS][STATUS_WORDS];
+    uint64_t seen = 0;
+    const char *monitor = NULL, *name;
+    time_t since = 0, until = 0;
+    unsigned flag = ALL_FLAGS, count, i, f, shown = 0;
+    uint8_t first;
+    int opt;
+
+    while((opt = getopt(argc, argv, "f:m:s:u:")) != -1) {
+        switch(opt) {
+            case 'f':
+                for(flag = 0; flag < STATUS_BUTTON_COUNT; ++flag) {
+                    if(!strcasecmp(statusButtons[flag].name, optarg)) break;
+                }
+                if(flag == STATUS_BUTTON_COUNT) {
+                    fprintf(stderr,"Unknown flag %s, one of:",optarg);
+                    for(f = 0; f < STATUS_BUTTON_COUNT; ++f) fprintf(stderr," %s",statusButtons[f].name);
+                    fprintf(stderr,"\n");
+                    return 1;
+                }
+            break;
+            case 'm':
+                monitor = optarg;
+            break;
+            case 's':
+                if(parseTime(optarg, &since)) goto badTime;
+            break;
+            case 'u':
+                if(parseTime(optarg, &until)) goto badTime;
+            break;
+            default:
+                goto usage;
+        }
+    }
+    if(optind != argc - 1) goto usage;
+    if(historyOpenRead(&h, argv[optind])) return 1;
+
+    records = malloc(h.hdr->capacity * sizeof(struct historyRecord));
+    if(records == NULL) {
+        historyClose(&h);
+        return 1;
+    }
+    count = historyCopy(&h, records);
+
+    // every record is followed to know what changed, only the range is printed
+    for(i = 0; i < count; ++i) {
+        rec = &records[i];
+        if(rec->monitor >= HISTORY_MAX_MONITORS) continue;
+        first = !(seen & (1ULL << rec->monitor));
+        name = rec->monitor < h.hdr->monitors ? h.hdr->names[rec->monitor] : "?";
+        if((monitor == NULL || strstr(name, monitor)) && rec->sec >= since && (until == 0 || rec->sec <= until)) {
+            if(flag != ALL_FLAGS) {
+                if(first || flagSet(previous[rec->monitor], flag) != flagSet(rec->status, flag)) {
+                    printWhen(rec, name);
+                    fprintf(stdout," %s %s%s\n",statusButtons[flag].name,
+                        flagSet(rec->status, flag) ? "on" : "off", first ? " (first seen)" : "");
+                    shown++;
+                }
+            } else {
+                printWhen(rec, name);
+                fprintf(stdout," %.04X %.04X %.04X %.04X %.04X",
+                    rec->status[0],rec->status[1],rec->status[2],rec->status[3],rec->status[4]);
+                for(f = 0; f < STATUS_BUTTON_COUNT; ++f) {
+                    if(first) {
+                        if(flagSet(rec->status, f)) fprintf(stdout," %s",statusButtons[f].name);
+                    } else if(flagSet(previous[rec->monitor], f) != flagSet(rec->status, f)) {
+                        fprintf(stdout," %c%s",flagSet(rec->status, f) ? '+' : '-',statusButtons[f].name);
+                    }
+                }
+                fprintf(stdout,"%s\n",first ? " (first seen)" : "");
+                shown++;
+            }
+        }
+        memcpy(previous[rec->monitor], rec->status, sizeof(rec->status));
+        seen |= 1ULL << rec->monitor;
+    }
+    if(shown == 0) fprintf(stderr,"No changes in %u record(s)\n",count);
+
+    free(records);
+    historyClose(&h);
+    return 0;
+
+badTime:
+    fprintf(stderr,"Could not make out the time %s\n",optarg);
+    return 1;
+
+usage:
+    fprintf(stderr,"Usage: %s [-f flag] [-m monitor] [-s since] [-u until] history\n"
+                   "Times are -30s, -15m, -2h, -1d, @epoch, \"YYYY-MM-DD[ HH:MM[:SS]]\" or HH:MM[:SS] today\n",argv[0]);
+    return 1;
+}
@@ -0,0 +1,482 @@
+// Asynchronous command engine for a single BKM monitor connection
+// (2022) Martin Hejnfelt (martin@hejnfelt.com)
+// See https://immerhax.com/?p=797 for more information
+// Licensed under the WTFPL, see LICENSE.txt
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+#include "bkm15r.h"
+#include "monitor.h"
+
+uint64_t monitorNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void monitorInit(struct monitor *mon) {
+    memset(mon, 0, sizeof(*mon));
+    mon->fd = -1;
+    mon->timeoutMs = MONITOR_DEFAULT_TIMEOUT_MS;
+    mon->window = MONITOR_DEFAULT_WINDOW;
+    mon->pollInterval = POLL_BASE_MS;
+    mon->connectTimeoutMs = MONITOR_CONNECT_TIMEOUT_MS;
+    parserInit(&mon->rx);
+}
+
+static void setSocketOptions(int fd) {
+    int on = 1, idle = KEEPALIVE_IDLE_S, interval = KEEPALIVE_INTERVAL_S, count = KEEPALIVE_COUNT;
+    // frames are tiny and latency is all that matters
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+    setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+}
+
+static void connected(struct monitor *mon) {
+    mon->connecting = 0;
+    mon->backoffMs = 0;
+    mon->nextPoll = monitorNow();
+    mon->stats.connects++;
+    if(mon->onConnect) mon->onConnect(mon);
+}
+
+// Starts connecting to mon->addr, returns 1 if no socket could be created
+// and 2 if the connect failed right away
+static int startConnect(struct monitor *mon) {
+    mon->fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(mon->fd == -1) {
+        return 1;
+    }
+    setSocketOptions(mon->fd);
+    fcntl(mon->fd, F_SETFL, fcntl(mon->fd, F_GETFL) | O_NONBLOCK);
+    if(connect(mon->fd, (struct sockaddr *)&mon->addr, sizeof(mon->addr)) < 0) {
+        if(errno != EINPROGRESS) {
+            close(mon->fd);
+            mon->fd = -1;
+            return 2;
+        }
+        mon->connecting = 1;
+        mon->connectDeadline = monitorNow() + (uint64_t)mon->connectTimeoutMs * 1000000ULL;
+        return 0;
+    }
+    connected(mon);
+    return 0;
+}
+
+static int setAddress(struct monitor *mon, const char *ip, uint16_t port) {
+    memset(&mon->addr, 0, sizeof(mon->addr));
+    if(inet_aton(ip, &mon->addr.sin_addr) == 0) {
+        return 2;
+    }
+    mon->addr.sin_family = AF_INET;
+    mon->addr.sin_port = htons(port);
+    snprintf(mon->name, sizeof(mon->name), "%s", ip);
+    return 0;
+}
+
+static int finishConnect(struct monitor *mon) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if(getsockopt(mon->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+        return 1;
+    }
+    connected(mon);
+    return 0;
+}
+
+int monitorConnect(struct monitor *mon, const char *ip, uint16_t port) {
+    struct pollfd pfd;
+    int rc = setAddress(mon, ip, port);
+
+    if(rc) return rc;
+    rc = startConnect(mon);
+    if(rc) return rc;
+    if(mon->connecting) {
+        pfd.fd = mon->fd;
+        pfd.events = POLLOUT;
+        while((rc = poll(&pfd, 1, mon->connectTimeoutMs)) < 0 && errno == EINTR);
+        if(rc <= 0 || finishConnect(mon)) {
+            monitorClose(mon);
+            return 2;
+        }
+    }
+    return 0;
+}
+
+static void scheduleReconnect(struct monitor *mon) {
+    mon->backoffMs = mon->backoffMs ? mon->backoffMs * 2 : RECONNECT_MIN_MS;
+    if(mon->backoffMs > RECONNECT_MAX_MS) mon->backoffMs = RECONNECT_MAX_MS;
+    mon->reconnectAt = monitorNow() + (uint64_t)mon->backoffMs * 1000000ULL;
+}
+
+int monitorStartConnect(struct monitor *mon, const char *ip, uint16_t port) {
+    int rc = setAddress(mon, ip, port);
+
+    if(rc) return rc;
+    rc = startConnect(mon);
+    if(rc == 2 && mon->reconnect) {
+        scheduleReconnect(mon);
+        return 0;
+    }
+    return rc;
+}
+
+void monitorClose(struct monitor *mon) {
+    if(mon->fd >= 0) close(mon->fd);
+    mon->fd = -1;
+    mon->connecting = 0;
+    mon->reconnect = 0;
+}
+
+static void report(struct monitor *mon, const char *fmt, ...) {
+    char text[128];
+    va_list args;
+
+    va_start(args, fmt);
+    vsnprintf(text, sizeof(text), fmt, args);
+    va_end(args);
+    if(mon->onMessage) mon->onMessage(mon, text);
+    else fprintf(stderr,"\n[%s] %s\n",mon->name,text);
+}
+
+static struct request* queueRequest(struct monitor *mon, uint8_t kind, unsigned stat, const char *name) {
+    struct request *req;
+    if(mon->count == MONITOR_MAX_QUEUE) {
+        report(mon, "Command queue full, dropping %s", name);
+        return NULL;
+    }
+    req = &mon->queue[(mon->head + mon->count) % MONITOR_MAX_QUEUE];
+    req->kind = kind;
+    req->stat = stat;
+    req->expired = 0;
+    req->name = name;
+    req->queued = monitorNow();
+    req->sent = 0;
+    req->deadline = 0;
+    return req;
+}
+
+// DEGAUSS has a length byte longer than what is sent (see protocol.c). A
+// monitor framing by the length byte would take the start of whatever came
+// right behind it as part of it, so nothing is written after such a frame
+// until its reply is in.
+static uint8_t isBarrier(const struct request *req) {
+    return req->length != sizeof(header) + req->data[sizeof(header) - 1];
+}
+
+static uint8_t barrierInflight(const struct monitor *mon) {
+    return mon->inflight > 0 &&
+        isBarrier(&mon->queue[(mon->head + mon->inflight - 1) % MONITOR_MAX_QUEUE]);
+}
+
+static int flushQueue(struct monitor *mon) {
+    struct iovec iov[MONITOR_MAX_QUEUE];
+    struct msghdr msg;
+    struct request *req;
+    unsigned i, last, frames = 0;
+    uint64_t now;
+    ssize_t written;
+
+    if(mon->fd < 0 || mon->connecting || barrierInflight(mon)) return 0;
+    last = mon->count < (unsigned)mon->window ? mon->count : (unsigned)mon->window;
+    for(i = mon->inflight; i < last; ++i) {
+        req = &mon->queue[(mon->head + i) % MONITOR_MAX_QUEUE];
+        iov[frames].iov_base = (uint8_t*)req->data + (i == mon->inflight ? mon->txOffset : 0);
+        iov[frames].iov_len = req->length - (i == mon->inflight ? mon->txOffset : 0);
+        frames++;
+        if(isBarrier(req)) break;
+    }
+    if(frames == 0) return 0;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = frames;
+    written = sendmsg(mon->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if(written < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : 1;
+    }
+
+    mon->stats.bytesSent += written;
+    now = monitorNow();
+    for(i = 0; i < frames && written > 0; ++i) {
+        req = &mon->queue[(mon->head + mon->inflight) % MONITOR_MAX_QUEUE];
+        if(mon->txOffset == 0) {
+            // the timeout runs from the first byte on the wire, not from
+            // when the request was queued behind others
+            req->sent = now;
+            req->deadline = now + (uint64_t)mon->timeoutMs * 1000000ULL;
+        }
+        if((size_t)written >= iov[i].iov_len) {
+            written -= iov[i].iov_len;
+            mon->txOffset = 0;
+            mon->inflight++;
+            if(mon->capture) captureWrite(mon->capture, CAPTURE_OUT, mon->captureChannel, req->data, req->length);
+        } else {
+            mon->txOffset += written;
+            written = 0;
+        }
+    }
+    return 0;
+}
+
+static void schedulePoll(struct monitor *mon, uint8_t changed) {
+    uint64_t now = monitorNow();
+
+    if(mon->fixedPollMs > 0) {
+        mon->pollInterval = mon->fixedPollMs;
+    } else if(mon->statusValid && !(mon->status[0] & POWER_ON_STATUS) && now >= mon->activeUntil) {
+        mon->pollInterval = POLL_HEARTBEAT_MS;
+    } else if(now < mon->activeUntil) {
+        mon->pollInterval = POLL_FAST_MS;
+    } else if(changed) {
+        mon->pollInterval = POLL_BASE_MS;
+    } else {
+        mon->pollInterval *= 2;
+        if(mon->pollInterval < POLL_BASE_MS) mon->pollInterval = POLL_BASE_MS;
+        if(mon->pollInterval > POLL_MAX_MS) mon->pollInterval = POLL_MAX_MS;
+    }
+    mon->nextPoll = now + (uint64_t)mon->pollInterval * 1000000ULL;
+}
+
+// A command just went through, so its effect should show up right away
+static void commandDone(struct monitor *mon) {
+    uint64_t now = monitorNow();
+    mon->activeUntil = now + (uint64_t)POLL_ACTIVE_MS * 1000000ULL;
+    if(mon->fixedPollMs <= 0) mon->nextPoll = now;
+}
+
+static void completeHead(struct monitor *mon, int result) {
+    // the slot is free for the callback to queue into, so it gets a copy
+    struct request req = mon->queue[mon->head];
+    if(req.data == mon->queue[mon->head].frame) req.data = req.frame;
+    if(req.kind == REQUEST_STATUS) mon->statusPending = 0;
+    else if(result == REQUEST_OK) commandDone(mon);
+    mon->head = (mon->head + 1) % MONITOR_MAX_QUEUE;
+    mon->count--;
+    mon->inflight--;
+    // a late reply to a request already reported as timed out is dropped
+    if(req.expired) return;
+    if(result == REQUEST_OK) statsLatency(&mon->stats.commands[req.stat], monitorNow() - req.sent);
+    else mon->stats.commands[req.stat].failures++;
+    if(mon->onComplete) mon->onComplete(mon, &req, result);
+}
+
+static void handleReply(struct monitor *mon, int result, const uint16_t *status) {
+    struct request *req;
+    uint8_t changed;
+
+    if(result == PARSE_STATUS) {
+        changed = !mon->statusValid || memcmp(mon->status, status, sizeof(mon->status)) != 0;
+        memcpy(mon->status, status, sizeof(mon->status));
+        mon->statusValid = 1;
+        schedulePoll(mon, changed);
+        if(changed && mon->history) historyAppend(mon->history, mon->historyMonitor, status);
+        if(mon->rules) evaluateRules(mon->rules, mon, status);
+        if(mon->onStatus) mon->onStatus(mon);
+    }
+    if(result == PARSE_BAD || result == PARSE_BAD_FRAME) {
+        mon->stats.malformed++;
+        report(mon, "Skipped malformed data from monitor");
+    }
+    // nothing asked for this
+    if(result == PARSE_BAD || mon->inflight == 0) return;
+
+    // replies come back in request order, one per request, and a frame that
+    // won't decode still took the place of one
+    req = &mon->queue[mon->head];
+    if(result != PARSE_BAD_FRAME && (req->kind == REQUEST_STATUS) == (result == PARSE_STATUS)) {
+        completeHead(mon, REQUEST_OK);
+    } else {
+        completeHead(mon, REQUEST_FAILED);
+    }
+}
+
+static int receive(struct monitor *mon) {
+    uint16_t status[STATUS_WORDS];
+    uint8_t *buf;
+    size_t space;
+    ssize_t n;
+    int result;
+
+    buf = parserWritePtr(&mon->rx, &space);
+    n = recv(mon->fd, buf, space, MSG_DONTWAIT);
+    if(n == 0) return 1;
+    if(n < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : 1;
+    }
+    if(mon->capture) captureWrite(mon->capture, CAPTURE_IN, mon->captureChannel, buf, n);
+    parserCommit(&mon->rx, n);
+    mon->stats.bytesReceived += n;
+
+    while((result = parserNext(&mon->rx, status)) != PARSE_NEED_MORE) {
+        handleReply(mon, result, status);
+    }
+    return 0;
+}
+
+// Requests past their deadline are reported once and stay queued, so that a
+// late reply still lines up with the right request. If the oldest one has
+// not been answered after another full timeout the monitor is considered gone.
+static int expireRequests(struct monitor *mon) {
+    struct request *req;
+    uint64_t now = monitorNow();
+    unsigned i, started = mon->inflight + (mon->txOffset > 0);
+
+    for(i = 0; i < started; ++i) {
+        req = &mon->queue[(mon->head + i) % MONITOR_MAX_QUEUE];
+        if(req->expired || now < req->deadline) continue;
+        req->expired = 1;
+        mon->stats.commands[req->stat].timeouts++;
+        if(req->kind == REQUEST_STATUS) {
+            mon->statusPending = 0;
+            schedulePoll(mon, 0);
+        }
+        if(mon->onComplete) mon->onComplete(mon, req, REQUEST_TIMEOUT);
+    }
+    if(started > 0) {
+        req = &mon->queue[mon->head];
+        if(req->expired && now >= req->deadline + (uint64_t)mon->timeoutMs * 1000000ULL) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static uint8_t submit(struct monitor *mon) {
+    mon->count++;
+    // get it on the wire right away, errors surface through poll
+    flushQueue(mon);
+    return 0;
+}
+
+uint8_t monitorCommand(struct monitor *mon, enum Command cmd, void *tag) {
+    if(monitorFrame(mon, cmd, commandData(cmd), commandLength(cmd), commands[cmd].name, tag)) return 1;
+    if(cmd == CMD_STATUS_GET) mon->statusPending = 1;
+    return 0;
+}
+
+uint8_t monitorFrame(struct monitor *mon, unsigned stat, const uint8_t *data, uint8_t length, const char *name, void *tag) {
+    uint8_t kind = stat < CMD_COUNT ? commands[stat].kind : REQUEST_BUTTON;
+    struct request *req = queueRequest(mon, kind, stat, name);
+    if(req == NULL) return 1;
+    req->tag = tag;
+    req->data = data;
+    req->length = length;
+    return submit(mon);
+}
+
+uint8_t monitorKnob(struct monitor *mon, enum Knobs knob, int8_t dir, uint8_t ticks, void *tag) {
+    struct request *req;
+    if(knob >= KNOB_NONE) return 1;
+    req = queueRequest(mon, REQUEST_BUTTON, STAT_KNOB(knob), knobTargets[knob]);
+    if(req == NULL) return 1;
+    req->tag = tag;
+    req->length = encodeKnobFrame(req->frame, knobTargets[knob], dir, ticks);
+    if(req->length == 0) return 1;
+    req->data = req->frame;
+    return submit(mon);
+}
+
+uint8_t monitorRequestStatus(struct monitor *mon) {
+    return monitorCommand(mon, CMD_STATUS_GET, NULL);
+}
+
+short monitorPollEvents(const struct monitor *mon) {
+    short events = POLLIN;
+    if(mon->fd < 0) return 0;
+    if(mon->connecting) return POLLOUT;
+    if(mon->count > mon->inflight && mon->inflight < (unsigned)mon->window && !barrierInflight(mon)) events |= POLLOUT;
+    return events;
+}
+
+static int msUntil(uint64_t next, uint64_t now) {
+    if(next == UINT64_MAX) return -1;
+    if(next <= now) return 0;
+    return (next - now + 999999) / 1000000;
+}
+
+int monitorPollTimeout(const struct monitor *mon) {
+    const struct request *req;
+    uint64_t now = monitorNow(), next = UINT64_MAX, deadline;
+    unsigned i, started = mon->inflight + (mon->txOffset > 0);
+
+    if(mon->fd < 0) return mon->reconnect ? msUntil(mon->reconnectAt, now) : -1;
+    if(mon->connecting) return msUntil(mon->connectDeadline, now);
+    for(i = 0; i < started; ++i) {
+        req = &mon->queue[(mon->head + i) % MONITOR_MAX_QUEUE];
+        deadline = req->deadline;
+        if(req->expired) {
+            if(i != 0) continue;
+            deadline += (uint64_t)mon->timeoutMs * 1000000ULL;
+        }
+        if(deadline < next) next = deadline;
+    }
+    if(mon->autoPoll && !mon->statusPending && mon->nextPoll < next) {
+        next = mon->nextPoll;
+    }
+    return msUntil(next, now);
+}
+
+// Whatever was on the wire is lost with the connection, so it is failed.
+// Requests not sent yet stay queued and go out once reconnected.
+static void dropConnection(struct monitor *mon) {
+    uint8_t wasConnected = !mon->connecting;
+
+    close(mon->fd);
+    mon->fd = -1;
+    mon->connecting = 0;
+    mon->inflight += mon->txOffset > 0;
+    mon->txOffset = 0;
+    while(mon->inflight > 0) completeHead(mon, REQUEST_FAILED);
+    parserInit(&mon->rx);
+    mon->statusValid = 0;
+    scheduleReconnect(mon);
+    if(wasConnected && mon->onDisconnect) mon->onDisconnect(mon);
+}
+
+static int handleEvents(struct monitor *mon, short revents) {
+    if(mon->connecting) {
+        if(revents == 0) return monitorNow() >= mon->connectDeadline;
+        if(finishConnect(mon)) return 1;
+    }
+    if(revents & (POLLIN | POLLHUP)) {
+        if(receive(mon)) return 1;
+    }
+    if(revents & (POLLERR | POLLNVAL)) return 1;
+    if(mon->autoPoll && !mon->statusPending && monitorNow() >= mon->nextPoll) {
+        // with the queue full the poll waits for the next interval, it's
+        // nothing anybody asked for
+        if(mon->count == MONITOR_MAX_QUEUE) schedulePoll(mon, 0);
+        else monitorRequestStatus(mon);
+    }
+    if(flushQueue(mon)) return 1;
+    return expireRequests(mon);
+}
+
+int monitorHandleEvents(struct monitor *mon, short revents) {
+    if(mon->fd < 0) {
+        if(!mon->reconnect) return 1;
+        if(monitorNow() < mon->reconnectAt) return 0;
+        if(startConnect(mon)) scheduleReconnect(mon);
+        return 0;
+    }
+    if(!handleEvents(mon, revents)) return 0;
+    if(!mon->connecting) mon->stats.disconnects++;
+    if(!mon->reconnect) return 1;
+    dropConnection(mon);
+    return 0;
+}
@@ -0,0 +1,147 @@
+// Asynchronous command engine for a single BKM monitor connection
+// (2022) Martin Hejnfelt (martin@hejnfelt.com)
+// See https://immerhax.com/?p=797 for more information
+// Licensed under the WTFPL, see LICENSE.txt
+
+#ifndef MONITOR_H
+#define MONITOR_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+#include "protocol.h"
+#include "stats.h"
+#include "capture.h"
+#include "history.h"
+#include "rules.h"
+
+#define MONITOR_MAX_QUEUE           (64)
+#define MONITOR_DEFAULT_TIMEOUT_MS  (1000)
+#define MONITOR_DEFAULT_WINDOW      (8)
+#define MONITOR_CONNECT_TIMEOUT_MS  (1000)
+
+// Reconnect attempts back off from the min to the max, so a monitor that
+// was power cycled is picked up again within a second of it coming back
+#define RECONNECT_MIN_MS            (50)
+#define RECONNECT_MAX_MS            (1000)
+
+// TCP keepalive, so a monitor that vanished from the network is noticed
+// even while nothing is being sent
+#define KEEPALIVE_IDLE_S            (2)
+#define KEEPALIVE_INTERVAL_S        (1)
+#define KEEPALIVE_COUNT             (3)
+
+// Adaptive status polling: fast right after a command, backing off while
+// nothing changes, and a slow heartbeat while the monitor is powered off
+#define POLL_FAST_MS                (50)
+#define POLL_ACTIVE_MS              (2000)
+#define POLL_BASE_MS                (250)
+#define POLL_MAX_MS                 (2000)
+#define POLL_HEARTBEAT_MS           (5000)
+
+enum RequestResult {
+    REQUEST_OK,
+    REQUEST_TIMEOUT,
+    REQUEST_FAILED
+};
+
+struct request {
+    uint8_t kind;
+    uint8_t stat;       // slot in the monitor's stats
+    uint8_t expired;
+    uint8_t length;
+    const uint8_t *data;    // prebuilt frame from the table, or frame below
+    uint8_t frame[sizeof(struct frame)];
+    const char *name;
+    void *tag;          // whatever the caller queued it with
+    uint64_t queued;    // ns, monotonic
+    uint64_t sent;      // ns, monotonic
+    uint64_t deadline;  // ns, monotonic
+};
+
+// Requests are kept in the order they were queued. Up to window of them are
+// written to the socket back-to-back, and replies are matched to them in
+// the same order as they come back.
+struct monitor {
+    int fd;
+    uint8_t connecting;
+    char name[32];      // address the monitor was connected to, for reporting
+    struct sockaddr_in addr;
+    int timeoutMs;
+    int window;
+
+    int connectTimeoutMs;
+    uint64_t connectDeadline;   // ns, monotonic
+    uint8_t reconnect;          // reconnect by itself instead of reporting the loss
+    int backoffMs;
+    uint64_t reconnectAt;       // ns, monotonic
+
+    struct request queue[MONITOR_MAX_QUEUE];
+    unsigned head;      // oldest request
+    unsigned count;     // requests queued, sent or not
+    unsigned inflight;  // requests written, waiting for a reply
+    unsigned txOffset;  // bytes of the next unsent frame already written
+
+    struct parser rx;
+
+    uint16_t status[5];
+    uint8_t statusValid;
+    uint8_t statusPending;
+
+    uint8_t autoPoll;       // let the engine poll status by itself
+    int fixedPollMs;        // poll at this interval instead, if set
+    int pollInterval;       // ms, current adaptive interval
+    uint64_t nextPoll;      // ns, monotonic
+    uint64_t activeUntil;   // ns, monotonic, fast polling after a command
+
+    struct monitorStats stats;
+    struct capture *capture;    // wire traffic is recorded here if set
+    uint8_t captureChannel;
+    struct history *history;    // status changes are logged here if set
+    uint8_t historyMonitor;
+    const struct rules *rules;  // acted on with every status reply if set
+    struct ruleState ruleState;
+
+    void (*onConnect)(struct monitor *mon);
+    void (*onDisconnect)(struct monitor *mon);  // only with reconnect set
+    void (*onStatus)(struct monitor *mon);
+    void (*onComplete)(struct monitor *mon, const struct request *req, int result);
+    // things the engine has to say, printed to stderr if not set
+    void (*onMessage)(struct monitor *mon, const char *text);
+    void *user;
+};
+
+uint64_t monitorNow(void);
+
+void monitorInit(struct monitor *mon);
+// Connects within connectTimeoutMs, 1 if no socket could be created and 2
+// if the connect failed
+int monitorConnect(struct monitor *mon, const char *ip, uint16_t port);
+// Same as monitorConnect, but returns right away and finishes the connect
+// from monitorHandleEvents. Commands can be queued in the meantime.
+// With reconnect set a failed connect is retried rather than returned.
+int monitorStartConnect(struct monitor *mon, const char *ip, uint16_t port);
+// Closes for good, no reconnecting after this
+void monitorClose(struct monitor *mon);
+
+// Queue a command, returns 0 on success and 1 if the queue is full
+// The tag is handed back with the request on completion.
+uint8_t monitorCommand(struct monitor *mon, enum Command cmd, void *tag);
+uint8_t monitorKnob(struct monitor *mon, enum Knobs knob, int8_t dir, uint8_t ticks, void *tag);
+uint8_t monitorRequestStatus(struct monitor *mon);
+// Queue an already encoded frame, which must stay valid until completion.
+// stat is the command, or STAT_KNOB(knob), it is accounted to.
+uint8_t monitorFrame(struct monitor *mon, unsigned stat, const uint8_t *data, uint8_t length, const char *name, void *tag);
+
+// Event loop integration: the poll events to wait for, the time in ms until
+// the next request deadline (-1 for none), and handling of whatever poll
+// reported. monitorHandleEvents returns non-zero once the connection is lost,
+// unless reconnect is set. Then requests in flight are failed, the loss is
+// reported through onDisconnect and the monitor is reconnected with backoff;
+// it has to be handled while fd is -1 too for that.
+short monitorPollEvents(const struct monitor *mon);
+int monitorPollTimeout(const struct monitor *mon);
+int monitorHandleEvents(struct monitor *mon, short revents);
+
+#endif
@@ -0,0 +1,351 @@
+// Local BKM monitor simulator speaking the BKM-15R protocol
+// (2022) Martin Hejnfelt (martin@hejnfelt.com)
+// See https://immerhax.com/?p=797 for more information
+// Licensed under the WTFPL, see LICENSE.txt
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+
+#include "bkm15r.h"
+
+#define SIM_MAX_CLIENTS     (64)
+#define SIM_MAX_RESPONSES   (256)
+#define SIM_RX_SIZE         (1024)
+#define SIM_DEFAULT_ADDRESS "127.0.0.1"
+
+// Text preceding the status words in a status response
+#define STATUS_PREFIX       STATUS_RETURN " " CURRENT " "
+// Frames are split by the length byte only. The first version of the app
+// sent DEGAUSS, whose length byte counts a TOGGLE that isn't sent, on its
+// own and still got an answer, so a frame that stops short is taken as it
+// stands once the line has been quiet this long. A frame sent right behind
+// it is read as the rest of it, as the hardware would.
+#define SIM_FRAME_GAP_MS    (50)
+
+struct response {
+    uint64_t due;   // ns, monotonic
+    uint8_t length;
+    uint8_t data[STATUS_RESPONSE_SIZE];
+};
+
+struct client {
+    int fd;
+    uint8_t rx[SIM_RX_SIZE];
+    size_t rxLength;
+    uint64_t rxAt;      // ns, monotonic, when bytes last came in
+    struct response responses[SIM_MAX_RESPONSES];
+    unsigned head;
+    unsigned count;
+    uint8_t txOffset;
+};
+
+struct client clients[SIM_MAX_CLIENTS];
+uint16_t status[STATUS_WORDS] = { POWER_ON_STATUS, 0x0000, 0x0000, 0x0000, 0x0000 };
+int latencyMs = 0;
+int jitterMs = 0;
+int verbose = 0;
+volatile sig_atomic_t quit = 0;
+
+uint64_t now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void onSignal(int sig) {
+    (void)sig;
+    quit = 1;
+}
+
+// Replies go out in request order, so a reply is never due before the one
+// queued ahead of it regardless of jitter
+struct response* queueResponse(struct client *c) {
+    struct response *r, *prev;
+    uint64_t due = now() + (uint64_t)latencyMs * 1000000ULL;
+
+    if(c->count == SIM_MAX_RESPONSES) return NULL;
+    if(jitterMs > 0) due += (uint64_t)(rand() % (jitterMs * 1000)) * 1000ULL;
+    if(c->count > 0) {
+        prev = &c->responses[(c->head + c->count - 1) % SIM_MAX_RESPONSES];
+        if(prev->due > due) due = prev->due;
+    }
+    r = &c->responses[(c->head + c->count) % SIM_MAX_RESPONSES];
+    r->due = due;
+    memcpy(r->data, header, sizeof(header));
+    r->length = sizeof(header);
+    c->count++;
+    return r;
+}
+
+uint8_t queueAck(struct client *c) {
+    return queueResponse(c) == NULL;
+}
+
+uint8_t queueStatus(struct client *c) {
+    static const char hex[] = "0123456789ABCDEF";
+    struct response *r = queueResponse(c);
+    uint8_t *p;
+    int w, d;
+
+    if(r == NULL) return 1;
+    r->data[sizeof(header)-1] = STATUS_RESPONSE_SIZE - sizeof(header);
+    memcpy(r->data + sizeof(header), STATUS_PREFIX, strlen(STATUS_PREFIX));
+    for(w = 0; w < STATUS_WORDS; ++w) {
+        p = r->data + STATUS_WORD_OFFSET + w * STATUS_WORD_STRIDE;
+        for(d = 0; d < 4; ++d) {
+            p[d] = hex[(status[w] >> (12 - d * 4)) & 0xF];
+        }
+        if(w < STATUS_WORDS - 1) p[4] = 0x20;
+    }
+    r->length = STATUS_RESPONSE_SIZE;
+    return 0;
+}
+
+void toggle(const char *button) {
+    unsigned i;
+    for(i = 0; i < STATUS_BUTTON_COUNT; ++i) {
+        if(strcmp(statusButtons[i].name, button)) continue;
+        // a powered off monitor only listens to the power button
+        if(!(status[0] & POWER_ON_STATUS) && statusButtons[i].mask != POWER_ON_STATUS) return;
+        status[statusButtons[i].word] ^= statusButtons[i].mask;
+        return;
+    }
+}
+
+// Handles one frame payload, "<command> <target> [argument]"
+// Returns 1 if the client should be dropped
+uint8_t handleFrame(struct client *c, char *payload) {
+    char *command, *target, *argument, *save = NULL;
+
+    if(verbose) fprintf(stdout,"[%d] %s\n",c->fd,payload);
+    command = strtok_r(payload, " ", &save);
+    target = strtok_r(NULL, " ", &save);
+    argument = strtok_r(NULL, " ", &save);
+    if(command == NULL) return 1;
+
+    if(!strcmp(command, STATUS_GET)) {
+        if(target == NULL || strcmp(target, CURRENT)) return 1;
+        return queueStatus(c);
+    }
+    if(!strcmp(command, STATUS_SET)) {
+        if(target == NULL) return 1;
+        if(argument != NULL && !strcmp(argument, TOGGLE)) toggle(target);
+        return queueAck(c);
+    }
+    if(!strcmp(command, INFO_BUTTON) || !strcmp(command, INFO_KNOB)) {
+        return queueAck(c);
+    }
+    fprintf(stderr,"Unknown command %s\n",command);
+    return 1;
+}
+
+// Takes the frame at the start of rx off with length bytes of payload
+// Returns 1 if the client should be dropped
+uint8_t takeFrame(struct client *c, size_t length) {
+    char payload[256];
+
+    // payloads may or may not carry a terminating NUL
+    memcpy(payload, c->rx + sizeof(header), length);
+    payload[length] = 0;
+    c->rxLength -= sizeof(header) + length;
+    memmove(c->rx, c->rx + sizeof(header) + length, c->rxLength);
+    return handleFrame(c, payload);
+}
+
+// Returns 1 if the client should be dropped
+uint8_t receive(struct client *c) {
+    size_t length;
+    ssize_t n;
+
+    n = recv(c->fd, c->rx + c->rxLength, sizeof(c->rx) - c->rxLength, MSG_DONTWAIT);
+    if(n == 0) return 1;
+    if(n < 0) return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : 1;
+    c->rxLength += n;
+    c->rxAt = now();
+
+    while(c->rxLength >= sizeof(header)) {
+        if(memcmp(c->rx, header, sizeof(header)-1)) {
+            fprintf(stderr,"Bad frame header from client %d\n",c->fd);
+            return 1;
+        }
+        length = c->rx[sizeof(header)-1];
+        if(c->rxLength < sizeof(header) + length) break;
+        if(takeFrame(c, length)) return 1;
+    }
+    return 0;
+}
+
+// A frame still short of its length byte after the line went quiet
+// Returns 1 if the client should be dropped
+uint8_t expireFrame(struct client *c, uint64_t t) {
+    if(c->rxLength <= sizeof(header)) return 0;
+    if(t < c->rxAt + (uint64_t)SIM_FRAME_GAP_MS * 1000000ULL) return 0;
+    if(verbose) fprintf(stdout,"[%d] frame cut short at %zu of %u bytes\n",c->fd,
+        c->rxLength - sizeof(header),c->rx[sizeof(header)-1]);
+    return takeFrame(c, c->rxLength - sizeof(header));
+}
+
+// Returns 1 if the client should be dropped
+uint8_t transmit(struct client *c, uint64_t t) {
+    struct response *r;
+    ssize_t n;
+
+    while(c->count > 0) {
+        r = &c->responses[c->head];
+        if(r->due > t) break;
+        n = send(c->fd, r->data + c->txOffset, r->length - c->txOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if(n < 0) return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : 1;
+        c->txOffset += n;
+        if(c->txOffset < r->length) break;
+        c->txOffset = 0;
+        c->head = (c->head + 1) % SIM_MAX_RESPONSES;
+        c->count--;
+    }
+    return 0;
+}
+
+void dropClient(struct client *c) {
+    if(verbose) fprintf(stdout,"[%d] disconnected\n",c->fd);
+    close(c->fd);
+    c->fd = -1;
+}
+
+int main(int argc, char *argv[])
+{
+    struct sockaddr_in addr;
+    struct pollfd fds[SIM_MAX_CLIENTS + 1];
+    int map[SIM_MAX_CLIENTS + 1];
+    const char *address = SIM_DEFAULT_ADDRESS;
+    int port = MONITOR_PORT;
+    int listenfd, fd, opt, nfds, i, timeout;
+    uint64_t t, next;
+    struct client *c;
+
+    while((opt = getopt(argc, argv, "a:p:l:j:ov")) != -1) {
+        switch(opt) {
+            case 'a':
+                address = optarg;
+            break;
+            case 'p':
+                port = atoi(optarg);
+            break;
+            case 'l':
+                latencyMs = atoi(optarg);
+            break;
+            case 'j':
+                jitterMs = atoi(optarg);
+            break;
+            case 'o':
+                status[0] &= ~POWER_ON_STATUS;
+            break;
+            case 'v':
+                verbose = 1;
+            break;
+            default:
+                fprintf(stderr,"Usage: %s [-a address] [-p port] [-l latency ms] [-j jitter ms] [-o start powered off] [-v]\n",argv[0]);
+                return 1;
+        }
+    }
+
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+    srand(time(NULL));
+    for(i = 0; i < SIM_MAX_CLIENTS; ++i) clients[i].fd = -1;
+
+    listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    if(listenfd == -1) {
+        fprintf(stderr,"Could not create socket\n");
+        return 1;
+    }
+    opt = 1;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_addr.s_addr = inet_addr(address);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if(bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listenfd, 16) < 0) {
+        fprintf(stderr,"Could not listen on %s:%d\n",address,port);
+        return 2;
+    }
+    fprintf(stdout,"Simulated monitor listening @ %s:%d (latency %dms, jitter %dms)\n",address,port,latencyMs,jitterMs);
+    fflush(stdout);
+
+    while(!quit) {
+        nfds = 0;
+        next = UINT64_MAX;
+        fds[nfds].fd = listenfd;
+        fds[nfds].events = POLLIN;
+        map[nfds++] = -1;
+        for(i = 0; i < SIM_MAX_CLIENTS; ++i) {
+            c = &clients[i];
+            if(c->fd < 0) continue;
+            fds[nfds].fd = c->fd;
+            fds[nfds].events = POLLIN;
+            if(c->count > 0) {
+                if(c->responses[c->head].due < next) next = c->responses[c->head].due;
+                if(c->txOffset > 0) fds[nfds].events |= POLLOUT;
+            }
+            if(c->rxLength > sizeof(header) && c->rxAt + (uint64_t)SIM_FRAME_GAP_MS * 1000000ULL < next) {
+                next = c->rxAt + (uint64_t)SIM_FRAME_GAP_MS * 1000000ULL;
+            }
+            map[nfds++] = i;
+        }
+
+        timeout = -1;
+        if(next != UINT64_MAX) {
+            t = now();
+            timeout = next <= t ? 0 : (int)((next - t + 999999) / 1000000);
+        }
+        if(poll(fds, nfds, timeout) < 0) {
+            if(errno == EINTR) continue;
+            fprintf(stderr,"Polling failed\n");
+            break;
+        }
+
+        if(fds[0].revents & POLLIN) {
+            fd = accept(listenfd, NULL, NULL);
+            if(fd >= 0) {
+                for(i = 0; i < SIM_MAX_CLIENTS && clients[i].fd >= 0; ++i);
+                if(i == SIM_MAX_CLIENTS) {
+                    close(fd);
+                } else {
+                    memset(&clients[i], 0, sizeof(clients[i]));
+                    clients[i].fd = fd;
+                    opt = 1;
+                    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+                    if(verbose) fprintf(stdout,"[%d] connected\n",fd);
+                }
+            }
+        }
+
+        t = now();
+        for(i = 1; i < nfds; ++i) {
+            c = &clients[map[i]];
+            if(fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                if(receive(c)) {
+                    dropClient(c);
+                    continue;
+                }
+            }
+            if(expireFrame(c, t) || transmit(c, t)) dropClient(c);
+        }
+        if(verbose) fflush(stdout);
+    }
+
+    for(i = 0; i < SIM_MAX_CLIENTS; ++i) {
+        if(clients[i].fd >= 0) close(clients[i].fd);
+    }
+    close(listenfd);
+    return 0;
+}
@@ -0,0 +1,226 @@
+// Status presets, snapshot of the toggles and minimal restore
+// (2022) Martin Hejnfelt (martin@hejnfelt.com)
+// See https://immerhax.com/?p=797 for more information
+// Licensed under the WTFPL, see LICENSE.txt
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "bkm15r.h"
+#include "protocol.h"
+#include "preset.h"
+
+#define POWER_BUTTON_INDEX  (0)
+
+struct restore {
+    const uint16_t *target;
+    uint8_t round;
+    uint8_t probed;
+    uint8_t finished;
+    uint8_t failed;
+    unsigned toggles;
+    unsigned missed;
+};
+
+int savePreset(const char *path, const uint16_t *s) {
+    FILE *f = fopen(path, "w");
+    if(f == NULL) {
+        fprintf(stderr,"Could not write preset %s\n",path);
+        return 1;
+    }
+    fprintf(f,"%.04X %.04X %.04X %.04X %.04X\n",s[0],s[1],s[2],s[3],s[4]);
+    if(fclose(f)) {
+        fprintf(stderr,"Could not write preset %s\n",path);
+        return 1;
+    }
+    return 0;
+}
+
+int loadPreset(const char *path, uint16_t *status) {
+    unsigned w[STATUS_WORDS];
+    int i, n;
+    FILE *f = fopen(path, "r");
+
+    if(f == NULL) {
+        fprintf(stderr,"Could not read preset %s\n",path);
+        return 1;
+    }
+    n = fscanf(f, "%4x %4x %4x %4x %4x", &w[0], &w[1], &w[2], &w[3], &w[4]);
+    fclose(f);
+    if(n != STATUS_WORDS) {
+        fprintf(stderr,"Preset %s is not five status words\n",path);
+        return 1;
+    }
+    for(i = 0; i < STATUS_WORDS; ++i) status[i] = w[i];
+    return 0;
+}
+
+// Drives mons until done returns non-zero. Monitors that drop out are
+// closed. Returns 1 if polling itself failed.
+static int drive(struct monitor *mons, int count, int (*done)(struct monitor *mons, int count)) {
+    struct pollfd fds[count];
+    int i, t, timeout;
+
+    while(!done(mons, count)) {
+        timeout = -1;
+        for(i = 0; i < count; ++i) {
+            fds[i].fd = mons[i].fd;
+            fds[i].events = mons[i].fd >= 0 ? monitorPollEvents(&mons[i]) : 0;
+            if(mons[i].fd < 0) continue;
+            t = monitorPollTimeout(&mons[i]);
+            if(t >= 0 && (timeout < 0 || t < timeout)) timeout = t;
+        }
+        if(poll(fds, count, timeout) < 0) {
+            if(errno == EINTR) continue;
+            fprintf(stderr,"Polling failed...\n");
+            return 1;
+        }
+        for(i = 0; i < count; ++i) {
+            if(mons[i].fd < 0) continue;
+            if(monitorHandleEvents(&mons[i], fds[i].revents)) {
+                fprintf(stderr,"Lost connection to monitor @ %s\n",mons[i].name);
+                monitorClose(&mons[i]);
+            }
+        }
+    }
+    return 0;
+}
+
+static uint8_t snapshotAsked;
+
+static int snapshotDone(struct monitor *mons, int count) {
+    (void)count;
+    if(mons->fd < 0 || mons->statusValid) return 1;
+    if(!mons->connecting && mons->count == 0) {
+        // asked and it timed out
+        if(snapshotAsked) return 1;
+        snapshotAsked = 1;
+        monitorRequestStatus(mons);
+    }
+    return 0;
+}
+
+int snapshotPreset(struct monitor *mon, const char *path) {
+    mon->autoPoll = 0;
+    mon->onStatus = NULL;
+    mon->onComplete = NULL;
+    snapshotAsked = 0;
+    if(drive(mon, 1, snapshotDone)) return 1;
+    if(!mon->statusValid) {
+        fprintf(stderr,"No status from monitor @ %s\n",mon->name);
+        return 1;
+    }
+    if(savePreset(path, mon->status)) return 1;
+    fprintf(stdout,"Saved %.04X %.04X %.04X %.04X %.04X to %s\n",
+        mon->status[0],mon->status[1],mon->status[2],mon->status[3],mon->status[4],path);
+    return 0;
+}
+
+static uint8_t differs(const struct monitor *mon, const uint16_t *target, unsigned i) {
+    const struct statusButton *b = &statusButtons[i];
+    // a monitor that is to be off only has to be off
+    if(!(target[0] & POWER_ON_STATUS) && i != POWER_BUTTON_INDEX) return 0;
+    return ((mon->status[b->word] ^ target[b->word]) & b->mask) != 0;
+}
+
+static void queueToggle(struct monitor *mon, struct restore *r, unsigned i) {
+    monitorCommand(mon, commandByName(statusButtons[i].name), NULL);
+    // read back right behind it, the reply tells whether it took
+    monitorCommand(mon, CMD_STATUS_GET, (void*)&statusButtons[i]);
+    r->toggles++;
+}
+
+static void onRestoreComplete(struct monitor *mon, const struct request *req, int result) {
+    struct restore *r = mon->user;
+    const struct statusButton *b = req->tag;
+
+    if(b == NULL || req->kind != REQUEST_STATUS) return;
+    if(result != REQUEST_OK || ((mon->status[b->word] ^ r->target[b->word]) & b->mask)) {
+        r->missed++;
+    }
+}
+
+// Starts the next round on a monitor that has nothing in flight
+static void planRound(struct monitor *mon, struct restore *r) {
+    uint8_t power;
+    unsigned i, remaining = 0;
+
+    if(!mon->statusValid) {
+        if(r->probed) {
+            fprintf(stderr,"[%s] No status from monitor\n",mon->name);
+            r->failed = r->finished = 1;
+            return;
+        }
+        r->probed = 1;
+        monitorRequestStatus(mon);
+        return;
+    }
+    for(i = 0; i < STATUS_BUTTON_COUNT; ++i) remaining += differs(mon, r->target, i);
+    if(remaining == 0) {
+        fprintf(stdout,"[%s] Restored with %u toggle(s)\n",mon->name,r->toggles);
+        r->finished = 1;
+        return;
+    }
+    if(r->round == PRESET_MAX_ROUNDS) {
+        fprintf(stderr,"[%s] Still differs after %d rounds:",mon->name,PRESET_MAX_ROUNDS);
+        for(i = 0; i < STATUS_BUTTON_COUNT; ++i) {
+            if(differs(mon, r->target, i)) fprintf(stderr," %s",statusButtons[i].name);
+        }
+        fprintf(stderr,"\n");
+        r->failed = r->finished = 1;
+        return;
+    }
+    r->round++;
+
+    // a powered off monitor only listens to the power button, so power
+    // goes first when turning on and last when turning off
+    power = differs(mon, r->target, POWER_BUTTON_INDEX);
+    if(power && (r->target[0] & POWER_ON_STATUS)) queueToggle(mon, r, POWER_BUTTON_INDEX);
+    for(i = 0; i < STATUS_BUTTON_COUNT; ++i) {
+        if(i != POWER_BUTTON_INDEX && differs(mon, r->target, i)) queueToggle(mon, r, i);
+    }
+    if(power && !(r->target[0] & POWER_ON_STATUS)) queueToggle(mon, r, POWER_BUTTON_INDEX);
+}
+
+static int restoreDone(struct monitor *mons, int count) {
+    struct restore *r;
+    int i, finished = 0;
+
+    for(i = 0; i < count; ++i) {
+        r = mons[i].user;
+        if(!r->finished && mons[i].fd < 0) r->failed = r->finished = 1;
+        if(!r->finished && !mons[i].connecting && mons[i].count == 0) planRound(&mons[i], r);
+        finished += r->finished;
+    }
+    return finished == count;
+}
+
+int restorePreset(struct monitor *mons, int count, const uint16_t *preset) {
+    struct restore *restores;
+    uint64_t start = monitorNow();
+    int i, rc = 0;
+
+    restores = calloc(count, sizeof(struct restore));
+    if(restores == NULL) return 1;
+    for(i = 0; i < count; ++i) {
+        restores[i].target = preset;
+        mons[i].user = &restores[i];
+        mons[i].autoPoll = 0;
+        mons[i].onStatus = NULL;
+        mons[i].onComplete = onRestoreComplete;
+    }
+
+    if(drive(mons, count, restoreDone)) rc = 1;
+    for(i = 0; i < count; ++i) {
+        if(restores[i].failed) rc = 1;
+        if(restores[i].missed) {
+            fprintf(stderr,"[%s] %u toggle(s) did not take the first time\n",mons[i].name,restores[i].missed);
+        }
+    }
+    fprintf(stdout,"Restore took %.1f ms\n",(monitorNow() - start) / 1e6);
+    free(restores);
+    return rc;
+}
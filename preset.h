@@ -0,0 +1,27 @@
+// Status presets, snapshot of the toggles and minimal restore
+// (2022) Martin Hejnfelt (martin@hejnfelt.com)
+// See https://immerhax.com/?p=797 for more information
+// Licensed under the WTFPL, see LICENSE.txt
+
+#ifndef PRESET_H
+#define PRESET_H
+
+#include "monitor.h"
+
+// Rounds of toggling before a monitor that won't follow is given up on
+#define PRESET_MAX_ROUNDS   (3)
+
+// A preset file holds the five status words as hex, "8000 0000 0020 0000 0000"
+int savePreset(const char *path, const uint16_t *status);
+int loadPreset(const char *path, uint16_t *status);
+
+// Reads the status of mon and writes it to path
+int snapshotPreset(struct monitor *mon, const char *path);
+
+// Brings every monitor in mons to the toggles in preset. Only the buttons
+// whose bits differ from the live status are sent, all in one pipelined
+// batch, each followed by a status read confirming it took. Whatever is
+// still off afterwards gets another round. Returns 0 if all monitors match.
+int restorePreset(struct monitor *mons, int count, const uint16_t *preset);
+
+#endif
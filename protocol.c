@@ -0,0 +1,223 @@
+// BKM-15R frame encoding
+// (2022) Martin Hejnfelt (martin@hejnfelt.com)
+// See https://immerhax.com/?p=797 for more information
+// Licensed under the WTFPL, see LICENSE.txt
+
+#include <string.h>
+#include <strings.h>
+
+#include "bkm15r.h"
+#include "protocol.h"
+
+// The length byte counts the payload text, plus its terminating NUL
+// where the monitor expects one
+#define FRAME(text, length)         { { FRAME_HEADER }, length, text }
+#define COMMAND(name, kind, text, nul) \
+    { name, kind, sizeof(text) - 1 + (nul), FRAME(text, sizeof(text) - 1 + (nul)) }
+#define TOGGLE_COMMAND(button)      COMMAND(button, REQUEST_BUTTON, STATUS_SET " " button " " TOGGLE, 0)
+#define INFO_COMMAND(button)        COMMAND(button, REQUEST_BUTTON, INFO_BUTTON " " button " ", 0)
+
+#define DEGAUSS_TEXT                STATUS_SET " " DEGAUSS_BUTTON " "
+
+const struct command commands[CMD_COUNT] = {
+    [CMD_POWER]         = TOGGLE_COMMAND(POWER_BUTTON),
+    // DEGAUSS is momentary and goes without the TOGGLE argument, but its
+    // length byte has always counted one (22 for the 16 bytes sent). That
+    // is kept as it is until someone checks it against a real BKM-15R, and
+    // the engine sends nothing behind it until it's answered.
+    [CMD_DEGAUSS]       = { DEGAUSS_BUTTON, REQUEST_BUTTON, sizeof(DEGAUSS_TEXT) - 1,
+                            FRAME(DEGAUSS_TEXT, sizeof(STATUS_SET " " DEGAUSS_BUTTON " " TOGGLE) - 1) },
+    [CMD_SCANMODE]      = TOGGLE_COMMAND(SCANMODE_BUTTON),
+    [CMD_HDELAY]        = TOGGLE_COMMAND(HDELAY_BUTTON),
+    [CMD_VDELAY]        = TOGGLE_COMMAND(VDELAY_BUTTON),
+    [CMD_MONOCHROME]    = TOGGLE_COMMAND(MONOCHROME_BUTTON),
+    [CMD_APERTURE]      = TOGGLE_COMMAND(APERTURE_BUTTON),
+    [CMD_COMB]          = TOGGLE_COMMAND(COMB_BUTTON),
+    [CMD_CHAR_OFF]      = TOGGLE_COMMAND(CHAR_OFF_BUTTON),
+    [CMD_COL_TEMP]      = TOGGLE_COMMAND(COL_TEMP_BUTTON),
+    [CMD_ASPECT]        = TOGGLE_COMMAND(ASPECT_BUTTON),
+    [CMD_EXTSYNC]       = TOGGLE_COMMAND(EXTSYNC_BUTTON),
+    [CMD_BLUE_ONLY]     = TOGGLE_COMMAND(BLUE_ONLY_BUTTON),
+    [CMD_R_CUTOFF]      = TOGGLE_COMMAND(R_CUTOFF_BUTTON),
+    [CMD_G_CUTOFF]      = TOGGLE_COMMAND(G_CUTOFF_BUTTON),
+    [CMD_B_CUTOFF]      = TOGGLE_COMMAND(B_CUTOFF_BUTTON),
+    [CMD_MARKER]        = TOGGLE_COMMAND(MARKER_BUTTON),
+    [CMD_CHROMA_UP]     = TOGGLE_COMMAND(CHROMA_UP_BUTTON),
+    [CMD_MAN_PHASE]     = TOGGLE_COMMAND(MAN_PHASE_BUTTON),
+    [CMD_MAN_CHROMA]    = TOGGLE_COMMAND(MAN_CHROMA_BUTTON),
+    [CMD_MAN_BRIGHT]    = TOGGLE_COMMAND(MAN_BRIGHT_BUTTON),
+    [CMD_MAN_CONTRAST]  = TOGGLE_COMMAND(MAN_CONTRAST_BUTTON),
+    [CMD_INP_ENTER]     = INFO_COMMAND(INFO_INP_ENTER),
+    [CMD_INP_DELETE]    = INFO_COMMAND(INFO_INP_DELETE),
+    [CMD_MENU]          = INFO_COMMAND(INFO_NAV_MENU),
+    [CMD_MENU_ENTER]    = INFO_COMMAND(INFO_NAV_MENUENT),
+    [CMD_MENU_UP]       = INFO_COMMAND(INFO_NAV_MENUUP),
+    [CMD_MENU_DOWN]     = INFO_COMMAND(INFO_NAV_MENUDOWN),
+    [CMD_DIGIT_0]       = INFO_COMMAND("0"),
+    [CMD_DIGIT_1]       = INFO_COMMAND("1"),
+    [CMD_DIGIT_2]       = INFO_COMMAND("2"),
+    [CMD_DIGIT_3]       = INFO_COMMAND("3"),
+    [CMD_DIGIT_4]       = INFO_COMMAND("4"),
+    [CMD_DIGIT_5]       = INFO_COMMAND("5"),
+    [CMD_DIGIT_6]       = INFO_COMMAND("6"),
+    [CMD_DIGIT_7]       = INFO_COMMAND("7"),
+    [CMD_DIGIT_8]       = INFO_COMMAND("8"),
+    [CMD_DIGIT_9]       = INFO_COMMAND("9"),
+    [CMD_STATUS_GET]    = COMMAND(STATUS_GET, REQUEST_STATUS, STATUS_GET " " CURRENT " 5", 1)
+};
+
+const char *knobTargets[KNOB_NONE] = {
+    [KNOB_PHASE]    = INFO_KNOB_PHASE,
+    [KNOB_CHROMA]   = INFO_KNOB_CHROMA,
+    [KNOB_BRIGHT]   = INFO_KNOB_BRIGHTNESS,
+    [KNOB_CONTRAST] = INFO_KNOB_CONTRAST
+};
+
+const char *knobNames[KNOB_NONE] = {
+    [KNOB_PHASE]    = "PHASE",
+    [KNOB_CHROMA]   = "CHROMA",
+    [KNOB_BRIGHT]   = "BRIGHT",
+    [KNOB_CONTRAST] = "CONTRAST"
+};
+
+enum Command commandByName(const char *name) {
+    int cmd;
+    for(cmd = 0; cmd < CMD_COUNT; ++cmd) {
+        if(!strcasecmp(commands[cmd].name, name)) break;
+    }
+    return cmd;
+}
+
+enum Knobs knobByName(const char *name) {
+    int knob;
+    for(knob = 0; knob < KNOB_NONE; ++knob) {
+        if(!strcasecmp(knobNames[knob], name)) break;
+    }
+    return knob;
+}
+
+static char* appendNumber(char *p, int value) {
+    if(value < 0) {
+        *p++ = '-';
+        value = -value;
+    }
+    if(value >= 100) *p++ = '0' + value / 100;
+    if(value >= 10) *p++ = '0' + (value / 10) % 10;
+    *p++ = '0' + value % 10;
+    return p;
+}
+
+uint8_t encodeKnobFrame(uint8_t *buf, const char *knob, int8_t dir, uint8_t ticks) {
+    struct frame *f = (struct frame*)buf;
+    size_t knobLength = strlen(knob);
+    char *p = f->payload;
+
+    // "INFOknob " + knob + " 96/-1/255"
+    if(strlen(INFO_KNOB) + knobLength + 11 > FRAME_PAYLOAD_MAX) return 0;
+    memcpy(f->header, header, sizeof(f->header));
+    memcpy(p, INFO_KNOB " ", strlen(INFO_KNOB) + 1);
+    p += strlen(INFO_KNOB) + 1;
+    memcpy(p, knob, knobLength);
+    p += knobLength;
+    memcpy(p, " 96/", 4);
+    p = appendNumber(p + 4, dir);
+    *p++ = '/';
+    p = appendNumber(p, ticks);
+    f->length = p - f->payload;
+    return sizeof(header) + f->length;
+}
+
+#define RING_MASK (PARSER_RING_SIZE - 1)
+
+// Whatever the length byte says, a frame fits in the ring, and the status
+// words are inside a status reply
+_Static_assert(PARSER_RING_SIZE >= sizeof(header) + UINT8_MAX, "ring too small for a frame");
+_Static_assert(STATUS_WORD_OFFSET + (STATUS_WORDS - 1) * STATUS_WORD_STRIDE + 4 <= STATUS_RESPONSE_SIZE, "status words outside the reply");
+#define RING(p, i) ((p)->ring[((p)->head + (i)) & RING_MASK])
+
+// Hex digit value plus one, so anything that isn't a hex digit reads as 0
+static const uint8_t hexDigit[256] = {
+    ['0'] = 0x1, ['1'] = 0x2, ['2'] = 0x3, ['3'] = 0x4, ['4'] = 0x5,
+    ['5'] = 0x6, ['6'] = 0x7, ['7'] = 0x8, ['8'] = 0x9, ['9'] = 0xA,
+    ['A'] = 0xB, ['B'] = 0xC, ['C'] = 0xD, ['D'] = 0xE, ['E'] = 0xF, ['F'] = 0x10,
+    ['a'] = 0xB, ['b'] = 0xC, ['c'] = 0xD, ['d'] = 0xE, ['e'] = 0xF, ['f'] = 0x10
+};
+
+void parserInit(struct parser *p) {
+    p->head = 0;
+    p->tail = 0;
+}
+
+uint8_t* parserWritePtr(struct parser *p, size_t *space) {
+    uint32_t used = p->tail - p->head;
+    uint32_t offset = p->tail & RING_MASK;
+    uint32_t free = PARSER_RING_SIZE - used;
+    uint32_t contiguous = PARSER_RING_SIZE - offset;
+
+    *space = free < contiguous ? free : contiguous;
+    return p->ring + offset;
+}
+
+void parserCommit(struct parser *p, size_t n) {
+    p->tail += n;
+}
+
+// Decodes the status words in place from the ring, returns 1 unless it's
+// a STATret reply with five space separated words of hex digits. A frame of
+// the right length but anything else in it must not pass for a status.
+static uint8_t decodeStatus(const struct parser *p, uint16_t *status) {
+    uint16_t words[STATUS_WORDS];
+    uint8_t digit, bad = 0;
+    unsigned i;
+    int w, d;
+
+    for(i = 0; i < strlen(STATUS_RETURN); ++i) {
+        bad |= RING(p, sizeof(header) + i) != (uint8_t)STATUS_RETURN[i];
+    }
+    for(w = 1; w < STATUS_WORDS; ++w) {
+        bad |= RING(p, STATUS_WORD_OFFSET + w * STATUS_WORD_STRIDE - 1) != ' ';
+    }
+    for(w = 0; w < STATUS_WORDS; ++w) {
+        words[w] = 0;
+        for(d = 0; d < 4; ++d) {
+            digit = hexDigit[RING(p, STATUS_WORD_OFFSET + w * STATUS_WORD_STRIDE + d)];
+            bad |= (digit == 0);
+            words[w] = (words[w] << 4) | ((digit - 1) & 0xF);
+        }
+    }
+    if(bad) return 1;
+    memcpy(status, words, sizeof(words));
+    return 0;
+}
+
+int parserNext(struct parser *p, uint16_t *status) {
+    uint32_t available = p->tail - p->head;
+    uint32_t length;
+    unsigned i;
+    int result;
+
+    if(available < sizeof(header)) return PARSE_NEED_MORE;
+
+    // the first six bytes (03 0B SONY) mark the start of a frame, anything
+    // else gets skipped up to the next candidate
+    for(i = 0; i < 6; ++i) {
+        if(RING(p, i) != (uint8_t)header[i]) {
+            p->head++;
+            while(p->head != p->tail && RING(p, 0) != (uint8_t)header[0]) p->head++;
+            return PARSE_BAD;
+        }
+    }
+
+    length = sizeof(header) + RING(p, sizeof(header)-1);
+    if(available < length) return PARSE_NEED_MORE;
+
+    if(length == BUTTON_RESPONSE_SIZE) {
+        result = PARSE_ACK;
+    } else if(length == STATUS_RESPONSE_SIZE) {
+        result = decodeStatus(p, status) ? PARSE_BAD_FRAME : PARSE_STATUS;
+    } else {
+        result = PARSE_OTHER;
+    }
+    p->head += length;
+    return result;
+}
@@ -0,0 +1,143 @@
+// BKM-15R frame encoding
+// (2022) Martin Hejnfelt (martin@hejnfelt.com)
+// See https://immerhax.com/?p=797 for more information
+// Licensed under the WTFPL, see LICENSE.txt
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+
+#include "bkm15r.h"
+
+// Every fixed command the app can send
+enum Command {
+    CMD_POWER,
+    CMD_DEGAUSS,
+    CMD_SCANMODE,
+    CMD_HDELAY,
+    CMD_VDELAY,
+    CMD_MONOCHROME,
+    CMD_APERTURE,
+    CMD_COMB,
+    CMD_CHAR_OFF,
+    CMD_COL_TEMP,
+    CMD_ASPECT,
+    CMD_EXTSYNC,
+    CMD_BLUE_ONLY,
+    CMD_R_CUTOFF,
+    CMD_G_CUTOFF,
+    CMD_B_CUTOFF,
+    CMD_MARKER,
+    CMD_CHROMA_UP,
+    CMD_MAN_PHASE,
+    CMD_MAN_CHROMA,
+    CMD_MAN_BRIGHT,
+    CMD_MAN_CONTRAST,
+    CMD_INP_ENTER,
+    CMD_INP_DELETE,
+    CMD_MENU,
+    CMD_MENU_ENTER,
+    CMD_MENU_UP,
+    CMD_MENU_DOWN,
+    CMD_DIGIT_0,
+    CMD_DIGIT_1,
+    CMD_DIGIT_2,
+    CMD_DIGIT_3,
+    CMD_DIGIT_4,
+    CMD_DIGIT_5,
+    CMD_DIGIT_6,
+    CMD_DIGIT_7,
+    CMD_DIGIT_8,
+    CMD_DIGIT_9,
+    CMD_STATUS_GET,
+    CMD_COUNT
+};
+
+// What the reply to a frame looks like
+enum RequestKind {
+    REQUEST_BUTTON,
+    REQUEST_STATUS
+};
+
+enum Knobs {
+    KNOB_PHASE,
+    KNOB_CHROMA,
+    KNOB_BRIGHT,
+    KNOB_CONTRAST,
+    KNOB_NONE
+};
+
+// INFOknob targets and short names, indexed by enum Knobs
+extern const char *knobTargets[KNOB_NONE];
+extern const char *knobNames[KNOB_NONE];
+
+#define FRAME_PAYLOAD_MAX   (32)
+
+// A complete frame as it goes on the wire, header and length byte
+// followed by the payload
+struct frame {
+    uint8_t header[sizeof(header)-1];
+    uint8_t length;
+    char payload[FRAME_PAYLOAD_MAX];
+};
+
+struct command {
+    const char *name;
+    uint8_t kind;       // enum RequestKind, what the reply looks like
+    uint8_t size;       // payload bytes sent, what the length byte says but for DEGAUSS
+    struct frame frame;
+};
+
+// Built at compile time, so sending a command is a single write straight
+// out of this table
+extern const struct command commands[CMD_COUNT];
+
+static inline const uint8_t* commandData(enum Command cmd) {
+    return (const uint8_t*)&commands[cmd].frame;
+}
+
+static inline uint8_t commandLength(enum Command cmd) {
+    return sizeof(header) + commands[cmd].size;
+}
+
+// Looks up a command by the name it goes by on the wire (POWER, MENUUP, 5,
+// ...), case insensitive. Returns CMD_COUNT if there is none.
+enum Command commandByName(const char *name);
+// Same for knobs by short name (PHASE, CHROMA, ...), KNOB_NONE if unknown
+enum Knobs knobByName(const char *name);
+
+// Encodes "INFOknob <knob> 96/<dir>/<ticks>" into buf, which must hold
+// sizeof(struct frame) bytes. Returns the frame length, 0 if it won't fit.
+uint8_t encodeKnobFrame(uint8_t *buf, const char *knob, int8_t dir, uint8_t ticks);
+
+// Incremental reader for the monitor's byte stream. Data is received
+// straight into a ring buffer and split into frames by the SONY header and
+// the length byte, however TCP happened to chunk it up.
+#define PARSER_RING_SIZE    (1024)  // power of two, holds several max size frames
+
+enum ParseResult {
+    PARSE_NEED_MORE,    // no complete frame buffered yet
+    PARSE_ACK,          // empty reply to a button/knob command
+    PARSE_STATUS,       // status reply, words decoded
+    PARSE_OTHER,        // well formed frame of a kind we don't know
+    PARSE_BAD,          // garbage skipped looking for a frame, answers nothing
+    PARSE_BAD_FRAME     // framed like a status reply but won't decode, still
+                        // the reply to whatever was asked
+};
+
+struct parser {
+    uint8_t ring[PARSER_RING_SIZE];
+    uint32_t head;  // free running read position
+    uint32_t tail;  // free running write position
+};
+
+void parserInit(struct parser *p);
+// Contiguous free space to receive into, and how much of it got filled
+uint8_t* parserWritePtr(struct parser *p, size_t *space);
+void parserCommit(struct parser *p, size_t n);
+// Takes the next frame off the ring. For PARSE_STATUS the five status
+// words are decoded into status, which is left alone otherwise.
+int parserNext(struct parser *p, uint16_t *status);
+
+#endif
@@ -4,237 +4,618 @@
 // Licensed under the WTFPL, see LICENSE.txt
 
 #include <stdio.h>
-#include <sys/socket.h>
-#include <arpa/inet.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <termios.h>
 #include <stdint.h>
 #include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <signal.h>
+
+#include "bkm15r.h"
+#include "monitor.h"
+#include "server.h"
+#include "script.h"
+#include "preset.h"
+#include "stats.h"
+#include "capture.h"
+#include "screen.h"
+#include "dashboard.h"
+#include "encoder.h"
+#include "history.h"
+#include "discover.h"
+#include "rules.h"
 
-#define MONITOR_PORT (53484)
 #define MONITOR_DEFAULT_IP "192.168.0.1"
+#define MAX_MONITORS       (64)
+#define MAX_ENCODERS       (4)
 
-// status word 1
-#define POWER_ON_STATUS     (0x8000)
-#define SCANMODE_STATUS     (0x0400)
-#define HDELAY_STATUS       (0x0200)
-#define VDELAY_STATUS       (0x0100)
-#define MONOCHROME_STATUS   (0x0080)
-#define CHAR_MUTE_STATUS    (0x0040)
-#define MARKER_MODE_STATUS  (0x0020)
-#define EXTSYNC_STATUS      (0x0010)
-#define APT_STATUS          (0x0008)
-#define CHROMA_UP_STATUS    (0x0004)
-#define ASPECT_STATUS       (0x0002)
-
-// status word 2
-// Unknown / unused
-
-// status word 3
-#define COL_TEMP_STATUS     (0x0040)
-#define COMB_STATUS         (0x0020)
-#define BLUE_ONLY_STATUS    (0x0010)
-#define R_CUTOFF_STATUS     (0x0004)
-#define G_CUTOFF_STATUS     (0x0002)
-#define B_CUTOFF_STATUS     (0x0001)
-
-// status word 4
-#define MAN_PHASE_STATUS    (0x0080)
-#define MAN_CHROMA_STATUS   (0x0040)
-#define MAN_BRIGHT_STATUS   (0x0020)
-#define MAN_CONTRAST_STATUS (0x0010)
-
-// status word 5
-// Unknown / unused
-
-// Status buttons
-#define POWER_BUTTON        "POWER"
-#define DEGAUSS_BUTTON      "DEGAUSS"
-
-#define SCANMODE_BUTTON     "SCANMODE"
-#define HDELAY_BUTTON       "HDELAY"
-#define VDELAY_BUTTON       "VDELAY"
-#define MONOCHROME_BUTTON   "MONOCHR"
-#define APERTURE_BUTTON     "APERTURE"
-#define COMB_BUTTON         "COMB"
-#define CHAR_OFF_BUTTON     "CHARMUTE"
-#define COL_TEMP_BUTTON     "COLADJ"
-
-#define ASPECT_BUTTON       "ASPECT"
-#define EXTSYNC_BUTTON      "EXTSYNC"
-#define BLUE_ONLY_BUTTON    "BLUEONLY"
-#define R_CUTOFF_BUTTON     "RCUTOFF"
-#define G_CUTOFF_BUTTON     "GCUTOFF"
-#define B_CUTOFF_BUTTON     "BCUTOFF"
-#define MARKER_BUTTON       "MARKER"
-#define CHROMA_UP_BUTTON    "CHROMAUP"
-
-#define MAN_PHASE_BUTTON    "MANPHASE"
-#define MAN_CHROMA_BUTTON   "MANCHR"
-#define MAN_BRIGHT_BUTTON   "MANBRT"
-#define MAN_CONTRAST_BUTTON "MANCONT"
-
-#define TOGGLE              "TOGGLE"
-#define CURRENT             "CURRENT"
-#define STATUS_GET          "STATget"
-#define STATUS_SET          "STATset"
-
-// Info buttons/knobs
-#define INFO_INP_ENTER      "ENTER"
-#define INFO_INP_DELETE     "DELETE"
-#define INFO_NAV_MENU       "MENU"
-#define INFO_NAV_MENUENT    "MENUENT"
-#define INFO_NAV_MENUUP     "MENUUP"
-#define INFO_NAV_MENUDOWN   "MENUDOWN"
-
-#define INFO_BUTTON         "INFObutton"
-
-#define INFO_KNOB_PHASE         "R PHASE"
-#define INFO_KNOB_CHROMA        "R CHROMA"
-#define INFO_KNOB_BRIGHTNESS    "R BRIGHTNESS"
-#define INFO_KNOB_CONTRAST      "R CONTRAST"
-
-#define INFO_KNOB           "INFOknob"
-
-const char header [13] = { 0x03, 0x0B, 'S', 'O', 'N', 'Y', 0x00, 0x00, 0x00, 0xB0, 0x00, 0x00, 0x00 };
-uint8_t status_response[53];
-uint8_t button_response[13];
-uint8_t packetBuf[40];
-int sockfd;
-
-uint8_t sendInfoButtonPacket(const char* button) {
-    uint8_t dataLength = sizeof(header)-1;
-    packetBuf[dataLength++] = strlen(INFO_BUTTON) + strlen(button) + 2;
-    memcpy(packetBuf+dataLength, INFO_BUTTON, strlen(INFO_BUTTON));
-    dataLength += strlen(INFO_BUTTON);
-    packetBuf[dataLength++] = 0x20;
-    memcpy(packetBuf+dataLength, button, strlen(button));
-    dataLength += strlen(button);
-    packetBuf[dataLength++] = 0x20;
-    if(send(sockfd, packetBuf, dataLength, 0) < 0) {
-        fprintf(stderr,"Failed sending %s\n",button);
-        return 1;
+#define KNOB_DEFAULT_WINDOW_MS  (30)
+#define KNOB_MAX_TICKS          (255)
+
+// With more than one monitor every command is broadcast to all of them
+struct monitor monitors[MAX_MONITORS];
+int monitorCount = 0;
+int requestTimeoutMs = MONITOR_DEFAULT_TIMEOUT_MS;
+int requestWindow = MONITOR_DEFAULT_WINDOW;
+int statusPollMs = 0;
+uint8_t interactive = 1;    // status line on the terminal, off in the one-shot modes
+uint8_t autoReconnect = 0;  // for the long running modes
+const char *statsSpec = NULL;
+const char *statsDumpPath = NULL;
+int statsFd = -1;
+struct capture wireCapture;
+struct history statusHistory;
+struct rules statusRules;
+int currentKnob = KNOB_NONE;
+struct encoder encoders[MAX_ENCODERS];
+int encoderCount = 0;
+
+// On a terminal the status is a full screen dashboard, redrawn at most once
+// per pass through the main loop and only where it changed
+uint8_t dashboard = 0;
+uint8_t screenDirty = 0;
+volatile sig_atomic_t screenResized = 0;
+struct screen screen;
+char lastMessage[128];
+
+void onResize(int sig) {
+    (void)sig;
+    screenResized = 1;
+}
+
+// Ctrl-C and kill leave through the same door as q, so the terminal is put
+// back and the capture, history and metrics are written out
+volatile sig_atomic_t stopRequested = 0;
+
+void onStop(int sig) {
+    (void)sig;
+    stopRequested = 1;
+}
+
+// Events go to the message line of the dashboard, or below the status line
+void notify(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    if(dashboard) {
+        vsnprintf(lastMessage, sizeof(lastMessage), fmt, args);
+        screenDirty = 1;
+    } else {
+        fprintf(stderr,"\n");
+        vfprintf(stderr, fmt, args);
+        fprintf(stderr,"\n");
     }
-    recv(sockfd, button_response,sizeof(button_response),0);
-    return 0;
+    va_end(args);
 }
 
-uint8_t sendStatusButtonTogglePacket(const char* button) {
-    uint8_t dataLength = sizeof(header)-1;
-    packetBuf[dataLength++] = strlen(STATUS_SET) + strlen(button) + strlen(TOGGLE) + 2;
-    memcpy(packetBuf+dataLength, STATUS_SET, strlen(STATUS_SET));
-    dataLength += strlen(STATUS_SET);
-    packetBuf[dataLength++] = 0x20;
-    memcpy(packetBuf+dataLength, button, strlen(button));
-    dataLength += strlen(button);
-    packetBuf[dataLength++] = 0x20;
-    memcpy(packetBuf+dataLength, TOGGLE, strlen(TOGGLE));
-    dataLength += strlen(TOGGLE);
-    if(send(sockfd, packetBuf, dataLength, 0) < 0) {
-        fprintf(stderr,"Failed sending %s\n",button);
-        return 1;
+void sendCommand(enum Command cmd) {
+    struct monitor *m;
+    for(m = monitors; m < monitors + monitorCount; ++m) {
+        if(m->fd < 0) continue;
+        monitorCommand(m, cmd, NULL);
+    }
+}
+
+// Knob ticks are gathered for knobWindowMs after the first one and sent as
+// a single INFOknob packet per knob. Opposite directions cancel out, so only
+// the net movement goes on the wire. Ticks are kept per monitor, so one
+// that lags behind doesn't hold up the others.
+int knobWindowMs = KNOB_DEFAULT_WINDOW_MS;
+int knobTimerfd = -1;
+int pendingKnobTicks[MAX_MONITORS][KNOB_NONE];
+uint8_t knobTimerArmed = 0;
+
+void armKnobTimer(void) {
+    struct itimerspec window;
+
+    if(knobTimerArmed || knobTimerfd < 0) return;
+    memset(&window, 0, sizeof(window));
+    window.it_value.tv_sec = knobWindowMs / 1000;
+    window.it_value.tv_nsec = (knobWindowMs % 1000) * 1000000L;
+    timerfd_settime(knobTimerfd, 0, &window, NULL);
+    knobTimerArmed = 1;
+}
+
+// Frames still waiting for the socket. Ticks for such a monitor are held
+// back until they are out, so it gets the net movement in one packet rather
+// than a backlog of stale ones.
+uint8_t knobBacklog(const struct monitor *m) {
+    return !m->connecting && m->count > m->inflight;
+}
+
+uint8_t knobsPending(const struct monitor *m) {
+    int *pending = pendingKnobTicks[m - monitors];
+    int knob;
+    for(knob = 0; knob < KNOB_NONE; ++knob) {
+        if(pending[knob] != 0) return 1;
     }
-    recv(sockfd, button_response,sizeof(button_response),0);
     return 0;
 }
 
-enum Knobs {
-    KNOB_PHASE,
-    KNOB_CHROMA,
-    KNOB_BRIGHT,
-    KNOB_CONTRAST,
-    KNOB_NONE
-};
+uint8_t flushMonitorKnobs(struct monitor *m) {
+    int *pending = pendingKnobTicks[m - monitors];
+    uint8_t rc = 0;
+    int knob, ticks;
 
-int currentKnob = KNOB_NONE;
-char knobStatus[20];
+    if(m->fd < 0) {
+        memset(pending, 0, sizeof(pendingKnobTicks[0]));
+        return 0;
+    }
+    for(knob = 0; knob < KNOB_NONE; ++knob) {
+        // a fast spin can be more than fits in one packet
+        while(pending[knob] != 0) {
+            ticks = abs(pending[knob]);
+            if(ticks > KNOB_MAX_TICKS) ticks = KNOB_MAX_TICKS;
+            rc |= monitorKnob(m, knob, pending[knob] > 0 ? 1 : -1, ticks, NULL);
+            pending[knob] -= pending[knob] > 0 ? ticks : -ticks;
+        }
+    }
+    return rc;
+}
 
-void turnKnob(int8_t dir, uint8_t ticks) {
-    uint8_t dataLength = sizeof(header)-1;
-    char *knob = NULL;
-    if(currentKnob == KNOB_NONE) return;
- 
-    snprintf(knobStatus,20,"96/%d/%d",dir,ticks);
+uint8_t flushKnob(void) {
+    struct itimerspec disarm;
+    struct monitor *m;
+    uint8_t rc = 0;
 
-    switch(currentKnob) {
-        case KNOB_PHASE:
-            knob = INFO_KNOB_PHASE;
-        break;
-        case KNOB_CHROMA:
-            knob = INFO_KNOB_CHROMA;
+    if(knobTimerfd >= 0) {
+        memset(&disarm, 0, sizeof(disarm));
+        timerfd_settime(knobTimerfd, 0, &disarm, NULL);
+    }
+    knobTimerArmed = 0;
+    for(m = monitors; m < monitors + monitorCount; ++m) rc |= flushMonitorKnobs(m);
+    return rc;
+}
+
+// Monitors that are caught up get their ticks, the rest get another window
+void knobWindowExpired(void) {
+    struct monitor *m;
+    uint8_t held = 0;
+
+    knobTimerArmed = 0;
+    for(m = monitors; m < monitors + monitorCount; ++m) {
+        if(!knobsPending(m)) continue;
+        if(m->fd >= 0 && knobBacklog(m)) {
+            held = 1;
+            continue;
+        }
+        flushMonitorKnobs(m);
+    }
+    if(held) armKnobTimer();
+}
+
+uint8_t queueKnobTicks(int knob, int ticks) {
+    struct monitor *m;
+    int *pending;
+    uint8_t rc = 0, held = 0;
+
+    if(knob == KNOB_NONE || ticks == 0) return 0;
+    for(m = monitors; m < monitors + monitorCount; ++m) {
+        // like commands, turns only go to monitors there's a connection to
+        if(m->fd < 0) continue;
+        pending = pendingKnobTicks[m - monitors];
+        pending[knob] += ticks;
+        if(knobWindowMs <= 0 || knobTimerfd < 0 ||
+            (abs(pending[knob]) >= KNOB_MAX_TICKS && !knobBacklog(m)))
+        {
+            rc |= flushMonitorKnobs(m);
+        } else {
+            held = 1;
+        }
+    }
+    if(held) armKnobTimer();
+    return rc;
+}
+
+uint16_t statusw1 = 0xFFFF,_statusw1 = 0xFFFF;
+uint16_t statusw2 = 0xFFFF,_statusw2 = 0xFFFF;
+uint16_t statusw3 = 0xFFFF,_statusw3 = 0xFFFF;
+uint16_t statusw4 = 0xFFFF,_statusw4 = 0xFFFF;
+uint16_t statusw5 = 0xFFFF,_statusw5 = 0xFFFF;
+uint8_t statusValid = 0;
+uint8_t knobselect = 0;
+uint8_t knobchanged = 1;
+
+void printKnobs(void) {
+    if(knobselect) {
+        printf(" - *P(H)ASE *CH(R)OMA *BR(I)GHT *CO(N)TRAST                   ");
+        return;
+    }
+    printf(" - ");
+    if(currentKnob == KNOB_PHASE) printf("*");
+    printf("PHASE ");
+    if(currentKnob == KNOB_CHROMA) printf("*");
+    printf("CHROMA ");
+    if(currentKnob == KNOB_BRIGHT) printf("*");
+    printf("BRIGHT ");
+    if(currentKnob == KNOB_CONTRAST) printf("*");
+    printf("CONTRAST                                       ");
+}
+
+uint16_t shownStatus[MAX_MONITORS][STATUS_WORDS];
+
+// Monitors on their way, including those waiting to reconnect
+int pendingConnects(void) {
+    struct monitor *m;
+    int connecting = 0;
+    for(m = monitors; m < monitors + monitorCount; ++m) {
+        if(m->connecting || (m->fd < 0 && m->reconnect)) connecting++;
+    }
+    return connecting;
+}
+
+int connectedMonitors(void) {
+    struct monitor *m;
+    int connected = 0;
+    for(m = monitors; m < monitors + monitorCount; ++m) {
+        if(m->fd >= 0 && !m->connecting) connected++;
+    }
+    return connected;
+}
+
+// In fleet mode each monitor gets a line of its own when its status
+// changes, the bottom line summarises the fleet and the knobs
+void updateFleetLine(void) {
+    if(!knobchanged && !knobselect) return;
+    printf("\rFleet: %d/%d connected",connectedMonitors(),monitorCount);
+    printKnobs();
+    knobchanged = 0;
+    fflush(stdout);
+}
+
+void updateStatusLine(void) {
+    if(!interactive) return;
+    if(dashboard) {
+        screenDirty = 1;
+        return;
+    }
+    if(monitorCount > 1) {
+        updateFleetLine();
+        return;
+    }
+    if(!statusValid) return;
+    if(statusw1 & POWER_ON_STATUS) {
+        if(statusw1 != _statusw1 || statusw2 != _statusw2 ||
+            statusw3 != _statusw3 || statusw4 != _statusw4 ||
+            statusw5 != _statusw5 || knobselect || knobchanged)
+        {
+            printf("\rStatus: %.04X %.04X %.04X %.04X %.04X",
+                statusw1,statusw2,statusw3,statusw4,statusw5);
+            printKnobs();
+            fflush(stdout);
+            _statusw1 = statusw1;
+            _statusw2 = statusw2;
+            _statusw3 = statusw3;
+            _statusw4 = statusw4;
+            _statusw5 = statusw5;
+            knobchanged = 0;
+        }
+    } else {
+        printf("\rMonitor is powered off...                               \r");
+        fflush(stdout);
+    }
+}
+
+void onFleetStatus(struct monitor *m) {
+    uint16_t *shown = shownStatus[m - monitors];
+    if(dashboard) {
+        screenDirty = 1;
+        return;
+    }
+    if(!memcmp(shown, m->status, sizeof(m->status))) return;
+    memcpy(shown, m->status, sizeof(m->status));
+    if(m->status[0] & POWER_ON_STATUS) {
+        printf("\r[%s] Status: %.04X %.04X %.04X %.04X %.04X                                  \n",
+            m->name,m->status[0],m->status[1],m->status[2],m->status[3],m->status[4]);
+    } else {
+        printf("\r[%s] Monitor is powered off...                                             \n",m->name);
+    }
+    knobchanged = 1;
+    updateFleetLine();
+}
+
+void onStatus(struct monitor *m) {
+    if(monitorCount > 1) {
+        onFleetStatus(m);
+        return;
+    }
+    statusw1 = m->status[0];
+    statusw2 = m->status[1];
+    statusw3 = m->status[2];
+    statusw4 = m->status[3];
+    statusw5 = m->status[4];
+    statusValid = 1;
+    updateStatusLine();
+}
+
+void redrawDashboard(void) {
+    struct dashboardState state;
+
+    if(screenResized) {
+        screenResized = 0;
+        screenResize(&screen);
+        screenDirty = 1;
+    }
+    if(!screenDirty) return;
+    state.knob = currentKnob;
+    state.knobSelect = knobselect;
+    state.message = lastMessage[0] ? lastMessage : NULL;
+    drawDashboard(&screen, monitors, monitorCount, &state);
+    screenFlush(&screen);
+    screenDirty = 0;
+}
+
+void onComplete(struct monitor *m, const struct request *req, int result) {
+    if(result != REQUEST_OK) {
+        notify("[%s] No answer from monitor for %s",m->name,req->name);
+        knobchanged = 1;
+    }
+}
+
+void onConnect(struct monitor *m) {
+    if(dashboard) {
+        notify("Connected to monitor @ %s",m->name);
+    } else {
+        fprintf(stdout,"\rConnected to monitor @ %s\n",m->name);
+    }
+    knobchanged = 1;
+    updateStatusLine();
+}
+
+// The knob selection and everything else on screen is kept, the status
+// line picks up again once the monitor answers
+void onDisconnect(struct monitor *m) {
+    notify("Lost connection to monitor @ %s, reconnecting...",m->name);
+    if(monitorCount == 1) statusValid = 0;
+    knobchanged = 1;
+}
+
+// The engine's own messages would otherwise go straight to the terminal,
+// under the dashboard
+void onMessage(struct monitor *m, const char *text) {
+    notify("[%s] %s",m->name,text);
+    knobchanged = 1;
+}
+
+void onRule(struct monitor *m, const struct rule *rule, int result) {
+    switch(result) {
+        case RULE_FIRED:
+            notify("[%s] Rule %s",m->name,rule->text);
         break;
-        case KNOB_BRIGHT:
-            knob = INFO_KNOB_BRIGHTNESS;
+        case RULE_HELD_OFF:
+            notify("[%s] Rule %s held off, it fired less than %dms ago",m->name,rule->text,RULE_HOLDOFF_MS);
         break;
-        case KNOB_CONTRAST:
         default:
-            knob = INFO_KNOB_CONTRAST;
-        break;
-    }
-    packetBuf[dataLength++] = strlen(INFO_KNOB) + strlen(knob) + strlen(knobStatus) + 2;
-    memcpy(packetBuf+dataLength, INFO_KNOB, strlen(INFO_KNOB));
-    dataLength += strlen(INFO_KNOB);
-    packetBuf[dataLength++] = 0x20;
-    memcpy(packetBuf+dataLength, knob, strlen(knob));
-    dataLength += strlen(knob);
-    packetBuf[dataLength++] = 0x20;
-    memcpy(packetBuf+dataLength, knobStatus, strlen(knobStatus));
-    dataLength += strlen(knobStatus);
-    if(send(sockfd, packetBuf, dataLength, 0) < 0) {
-        fprintf(stderr,"Failed sending %s\n",knob);
-        return;
+            notify("[%s] Rule %s could not be queued",m->name,rule->text);
     }
-    recv(sockfd, button_response,sizeof(button_response),0);
 }
 
-int main(int argc , char *argv[])
-{
-    int rc = 0;
-	struct sockaddr_in monitor;
-    int disconnect = 0;
-    struct termios ctrl;
-    uint8_t dataLength,l,knobselect=0,knobchanged=1;
-    uint16_t statusw1 = 0xFFFF,_statusw1 = 0xFFFF;
-    uint16_t statusw2 = 0xFFFF,_statusw2 = 0xFFFF;
-    uint16_t statusw3 = 0xFFFF,_statusw3 = 0xFFFF;
-    uint16_t statusw4 = 0xFFFF,_statusw4 = 0xFFFF;
-    uint16_t statusw5 = 0xFFFF,_statusw5 = 0xFFFF;
-    char command;
+// Takes "ip" or "ip:port"
+int addMonitor(const char *address) {
+    struct monitor *m;
+    char ip[32];
+    const char *colon = strchr(address, ':');
+    int port = MONITOR_PORT;
+    size_t len = colon ? (size_t)(colon - address) : strlen(address);
 
-    const char get_status[31] = { 0x03,0x0b,0x53,0x4f,0x4e,0x59,0x00,0x00,0x00,0xb0,0x00,0x00,0x12,0x53,0x54,0x41,0x54,0x67,0x65,0x74,0x20,0x43,0x55,0x52,0x52,0x45,0x4e,0x54,0x20,0x35,0x00 };
+    if(monitorCount == MAX_MONITORS || len >= sizeof(ip)) return 1;
+    memcpy(ip, address, len);
+    ip[len] = 0;
+    if(colon) port = atoi(colon + 1);
 
-    printf("Sony BKM-15R emulator\n");
-    printf("(2022) Martin Hejnfelt (martin@hejnfelt.com)\n");
-    printf("www.immerhax.com\n\n");
+    m = &monitors[monitorCount];
+    monitorInit(m);
+    m->timeoutMs = requestTimeoutMs;
+    m->window = requestWindow;
+    // status is polled by the engine, on its own schedule per monitor
+    m->autoPoll = 1;
+    m->fixedPollMs = statusPollMs;
+    m->reconnect = autoReconnect;
+    if(wireCapture.f) {
+        m->capture = &wireCapture;
+        m->captureChannel = monitorCount;
+    }
+    if(statusHistory.hdr) {
+        m->history = &statusHistory;
+        m->historyMonitor = historyMonitor(&statusHistory, address);
+    }
+    // rules only make sense where the monitor is looked after for a while
+    if(statusRules.count > 0 && autoReconnect) m->rules = &statusRules;
+    m->onConnect = onConnect;
+    m->onDisconnect = onDisconnect;
+    m->onStatus = onStatus;
+    m->onComplete = onComplete;
+    m->onMessage = onMessage;
+    if(monitorStartConnect(m, ip, port)) {
+        fprintf(stderr,"Could not connect to %s\n",address);
+        return 1;
+    }
+    snprintf(m->name, sizeof(m->name), "%s", address);
+    memset(shownStatus[monitorCount], 0xFF, sizeof(shownStatus[monitorCount]));
+    monitorCount++;
+    return 0;
+}
 
-    memcpy(packetBuf,header,sizeof(header));
- 
-    fcntl(0, F_SETFL, fcntl(0, F_GETFL) | O_NONBLOCK);
-    tcgetattr(STDIN_FILENO, &ctrl);
-    ctrl.c_lflag &= ~ICANON; // make input unbuffered, so enter after keypress isn't needed
-    ctrl.c_lflag &= ~ECHO; // turn off echo so we don't see the keypresses
-    tcsetattr(STDIN_FILENO, TCSANOW, &ctrl);
+enum KeyState {
+    KEY_NORMAL,
+    KEY_ESCAPE,
+    KEY_CSI
+};
 
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-	if (sockfd == -1)
-	{
-		fprintf(stderr,"Could not create socket");
-		return 1;
-	}
+int keyState = KEY_NORMAL;
 
-    monitor.sin_addr.s_addr = inet_addr(MONITOR_DEFAULT_IP);
-	monitor.sin_family = AF_INET;
-	monitor.sin_port = htons(MONITOR_PORT);
+// Handles a single byte of terminal input. Escape sequences may be split
+// over several reads, so their progress is kept in keyState.
+// Commands are only queued here, a monitor not keeping up gets reported
+// by the engine. Returns 1 when asked to quit, otherwise 0
+int handleKey(char command) {
+    // Anything but another knob tick has to go out after the pending ticks
+    if(keyState != KEY_NORMAL || knobselect || (command != '+' && command != '-')) {
+        flushKnob();
+    }
 
-    fprintf(stdout,"Connecting to monitor @ %s:%d\n",MONITOR_DEFAULT_IP,MONITOR_PORT);
-	if (connect(sockfd , (struct sockaddr *)&monitor , sizeof(monitor)) < 0)
-	{
-		fprintf(stderr,"Could not connect");
-		return 2;
+    if(keyState == KEY_ESCAPE) {
+        keyState = (command == 0x5B) ? KEY_CSI : KEY_NORMAL;
+        return 0;
+    }
+    if(keyState == KEY_CSI) {
+        keyState = KEY_NORMAL;
+        switch(command) {
+            case 0x41: // up
+                sendCommand(CMD_MENU_UP);
+            break;
+            case 0x42: // down
+                sendCommand(CMD_MENU_DOWN);
+            break;
+            default:
+            break;
+        }
+        return 0;
+    }
+
+    if(knobselect) {
+        switch(command) {
+            case 'H':
+                currentKnob = KNOB_PHASE;
+            break;
+            case 'R':
+                currentKnob = KNOB_CHROMA;
+            break;
+            case 'I':
+                currentKnob = KNOB_BRIGHT;
+            break;
+            case 'N':
+                currentKnob = KNOB_CONTRAST;
+            break;
+            default:
+                currentKnob = KNOB_NONE;
+            break;
+        }
+        knobselect = 0;
+        knobchanged = 1;
+        return 0;
+    }
+
+    switch(command) {
+        case '+':
+            queueKnobTicks(currentKnob, 1);
+        break;
+        case '-':
+            queueKnobTicks(currentKnob, -1);
+        break;
+        case '0':
+        case '1':
+        case '2':
+        case '3':
+        case '4':
+        case '5':
+        case '6':
+        case '7':
+        case '8':
+        case '9':
+            sendCommand(CMD_DIGIT_0 + (command - '0'));
+        break;
+        case 'd':
+            sendCommand(CMD_INP_DELETE);
+        break;
+        case 'e':
+            sendCommand(CMD_INP_ENTER);
+        break;
+        case 'm':
+            sendCommand(CMD_MENU);
+        break;
+        case 0x1B:
+            keyState = KEY_ESCAPE;
+        break;
+        case 0x0A:
+            sendCommand(CMD_MENU_ENTER);
+        break;
+        case 'P':
+            sendCommand(CMD_POWER);
+        break;
+        case 'D':
+            sendCommand(CMD_DEGAUSS);
+        break;
+        case 'u':
+            sendCommand(CMD_SCANMODE);
+        break;
+        case 'h':
+            sendCommand(CMD_HDELAY);
+        break;
+        case 'v':
+            sendCommand(CMD_VDELAY);
+        break;
+        case 'o':
+            sendCommand(CMD_MONOCHROME);
+        break;
+        case 'A':
+            sendCommand(CMD_APERTURE);
+        break;
+        case 'c':
+            sendCommand(CMD_COMB);
+        break;
+        case 'C':
+            sendCommand(CMD_CHAR_OFF);
+        break;
+        case 'T':
+            sendCommand(CMD_COL_TEMP);
+        break;
+        case 'a':
+            sendCommand(CMD_ASPECT);
+        break;
+        case 's':
+            sendCommand(CMD_EXTSYNC);
+        break;
+        case 'B':
+            sendCommand(CMD_BLUE_ONLY);
+        break;
+        case 'r':
+            sendCommand(CMD_R_CUTOFF);
+        break;
+        case 'g':
+            sendCommand(CMD_G_CUTOFF);
+        break;
+        case 'b':
+            sendCommand(CMD_B_CUTOFF);
+        break;
+        case 'K':
+            sendCommand(CMD_MARKER);
+        break;
+        case 'U':
+            sendCommand(CMD_CHROMA_UP);
+        break;
+        case 'H':
+            sendCommand(CMD_MAN_PHASE);
+        break;
+        case 'R':
+            sendCommand(CMD_MAN_CHROMA);
+        break;
+        case 'I':
+            sendCommand(CMD_MAN_BRIGHT);
+        break;
+        case 'N':
+            sendCommand(CMD_MAN_CONTRAST);
+        break;
+        case 'k':
+            knobselect = !knobselect;
+            knobchanged = 1;
+        break;
+        case 0x0C: // ctrl-l
+            if(dashboard) screenResized = 1;
+        break;
+        case 'q':
+            return 1;
+        default:
+        break;
     }
+    return 0;
+}
 
-    fprintf(stdout,"Connected, starting loop\n");
+void printKeys(void) {
     fprintf(stdout,"Supported keys:\n");
     fprintf(stdout,"P - (P)ower\n");
     fprintf(stdout,"D - (D)egauss\n");
@@ -273,262 +654,387 @@ int main(int argc , char *argv[])
     fprintf(stdout,"e - Input (e)nter\n");
     fprintf(stdout,"d - Input (d)elete\n");
     fprintf(stdout,"\nq - Quit program\n\n");
- 
-    while(!disconnect) {
-        if(read(0, &command, 1) == 1) {
-            if(knobselect) {
-                switch(command) {
-                    case 'H':
-                        currentKnob = KNOB_PHASE;
-                    break;
-                    case 'R':
-                        currentKnob = KNOB_CHROMA;
-                    break;
-                    case 'I':
-                        currentKnob = KNOB_BRIGHT;
-                    break;
-                    case 'N':
-                        currentKnob = KNOB_CONTRAST;
-                    break;
-                    default:
-                        currentKnob = KNOB_NONE;
-                    break;
-                }
-                knobselect = 0;
-                knobchanged = 1;
+}
+
+// Metrics scrapes, encoders and monitors take up the poll slots from
+// FD_STATS, FD_ENCODERS and FD_MONITORS onwards
+enum PollFds {
+    FD_INPUT,
+    FD_KNOB_TIMER,
+    FD_STATS,
+    FD_ENCODERS = FD_STATS + STATS_POLL_FDS,
+    FD_MONITORS = FD_ENCODERS + MAX_ENCODERS
+};
+
+// Everything the encoders have is read at once, so however fast they are
+// spun it adds up to one knob packet per window
+void handleEncoderEvents(struct pollfd *fds) {
+    struct encoder *enc;
+    int ticks[KNOB_NONE + 1];
+    int i, knob;
+
+    memset(ticks, 0, sizeof(ticks));
+    for(i = 0; i < encoderCount; ++i) {
+        enc = &encoders[i];
+        if(enc->fd < 0 || !fds[FD_ENCODERS + i].revents) continue;
+        if(encoderRead(enc, ticks)) {
+            notify("Lost encoder %s",enc->path);
+            encoderClose(enc);
+            fds[FD_ENCODERS + i].fd = -1;
+        }
+    }
+    for(knob = 0; knob < KNOB_NONE; ++knob) queueKnobTicks(knob, ticks[knob]);
+    queueKnobTicks(currentKnob, ticks[KNOB_NONE]);
+}
+
+// Returns non-zero once no monitor is left to talk to
+int handleMonitorEvents(struct pollfd *fds) {
+    struct monitor *m;
+    int i;
+
+    for(i = 0; i < monitorCount; ++i) {
+        m = &monitors[i];
+        if(m->fd < 0 && !m->reconnect) continue;
+        if(monitorHandleEvents(m, fds[FD_MONITORS + i].revents)) {
+            if(m->connecting) {
+                notify("Could not connect to monitor @ %s",m->name);
             } else {
-                switch(command) {
-                    case '+':
-                        turnKnob(1,1);
-                    break;
-                    case '-':
-                        turnKnob(-1,1);
-                    break;
-                    case '0':
-                    case '1':
-                    case '2':
-                    case '3':
-                    case '4':
-                    case '5':
-                    case '6':
-                    case '7':
-                    case '8':
-                    case '9':
-                        dataLength = sizeof(header)-1;
-                        packetBuf[dataLength++] = strlen(INFO_BUTTON) + 3;
-                        memcpy(packetBuf+dataLength, INFO_BUTTON, strlen(INFO_BUTTON));
-                        dataLength += strlen(INFO_BUTTON);
-                        packetBuf[dataLength++] = 0x20;
-                        packetBuf[dataLength++] = command;
-                        packetBuf[dataLength++] = 0x20;
-                        if(send(sockfd, packetBuf, dataLength, 0) < 0) {
-                            goto fail;
-                        }
-                        recv(sockfd, button_response,sizeof(button_response),0);
-                    break;
-                    case 'd':
-                        if(sendInfoButtonPacket(INFO_INP_DELETE)) goto fail;
-                    break;
-                    case 'e':
-                        if(sendInfoButtonPacket(INFO_INP_ENTER)) goto fail;
-                    break;                
-                    case 'm':
-                        if(sendInfoButtonPacket(INFO_NAV_MENU)) goto fail;
-                    break;
-                    case 0x1B:
-                        if(read(0, &command, 1) == 1) {
-                            switch(command) {
-                                case 0x5B:
-                                    if(read(0, &command, 1) == 1) {
-                                        switch(command) {
-                                            case 0x41: // up
-                                                if(sendInfoButtonPacket(INFO_NAV_MENUUP)) goto fail;
-                                            break;
-                                            case 0x42: // down
-                                                if(sendInfoButtonPacket(INFO_NAV_MENUDOWN)) goto fail;
-                                            break;
-                                            default:
-                                            break;
-                                        }
-                                    }
-                                break;
-                                default:
-                                break;
-                            }
-                        }
-                    break;
-                    case 0x0A:
-                        if(sendInfoButtonPacket(INFO_NAV_MENUENT)) goto fail;
-                    break;
-                    case 'P':
-                        if(sendStatusButtonTogglePacket(POWER_BUTTON)) goto fail;
-                    break;
-                    case 'D':
-                        dataLength = sizeof(header)-1;
-                        packetBuf[dataLength++] = strlen(STATUS_SET) + strlen(DEGAUSS_BUTTON) + strlen(TOGGLE) + 2;
-                        memcpy(packetBuf+dataLength, STATUS_SET, strlen(STATUS_SET));
-                        dataLength += strlen(STATUS_SET);
-                        packetBuf[dataLength++] = 0x20;
-                        memcpy(packetBuf+dataLength, DEGAUSS_BUTTON, strlen(DEGAUSS_BUTTON));
-                        dataLength += strlen(DEGAUSS_BUTTON);
-                        packetBuf[dataLength++] = 0x20;
-                        if(send(sockfd, packetBuf, dataLength, 0) < 0) {
-                            fprintf(stderr,"Failed sending %s\n",DEGAUSS_BUTTON);
-                            goto fail;
-                        }
-                        recv(sockfd, button_response,sizeof(button_response),0);
-                    break;
-                    case 'u':
-                        if(sendStatusButtonTogglePacket(SCANMODE_BUTTON)) goto fail;
-                    break;
-                    case 'h':
-                        if(sendStatusButtonTogglePacket(HDELAY_BUTTON)) goto fail;
-                    break;
-                    case 'v':
-                        if(sendStatusButtonTogglePacket(VDELAY_BUTTON)) goto fail;
-                    break;
-                    case 'o':
-                        if(sendStatusButtonTogglePacket(MONOCHROME_BUTTON)) goto fail;
-                    break;
-                    case 'A':
-                        if(sendStatusButtonTogglePacket(APERTURE_BUTTON)) goto fail;
-                    break;
-                    case 'c':
-                        if(sendStatusButtonTogglePacket(COMB_BUTTON)) goto fail;
-                    break;
-                    case 'C':
-                        if(sendStatusButtonTogglePacket(CHAR_OFF_BUTTON)) goto fail;
-                    break;
-                    case 'T':
-                        if(sendStatusButtonTogglePacket(COL_TEMP_BUTTON)) goto fail;
-                    break;
-                    case 'a':
-                        if(sendStatusButtonTogglePacket(ASPECT_BUTTON)) goto fail;
-                    break;
-                    case 's':
-                        if(sendStatusButtonTogglePacket(EXTSYNC_BUTTON)) goto fail;
-                    break;
-                    case 'B':
-                        if(sendStatusButtonTogglePacket(BLUE_ONLY_BUTTON)) goto fail;
-                    break;
-                    case 'r':
-                        if(sendStatusButtonTogglePacket(R_CUTOFF_BUTTON)) goto fail;
-                    break;
-                    case 'g':
-                        if(sendStatusButtonTogglePacket(G_CUTOFF_BUTTON)) goto fail;
-                    break;
-                    case 'b':
-                        if(sendStatusButtonTogglePacket(B_CUTOFF_BUTTON)) goto fail;
-                    break;
-                    case 'K':
-                        if(sendStatusButtonTogglePacket(MARKER_BUTTON)) goto fail;
-                    break;
-                    case 'U':
-                        if(sendStatusButtonTogglePacket(CHROMA_UP_BUTTON)) goto fail;
-                    break;
-                    case 'H':
-                        if(sendStatusButtonTogglePacket(MAN_PHASE_BUTTON)) goto fail;
-                    break;
-                    case 'R':
-                        if(sendStatusButtonTogglePacket(MAN_CHROMA_BUTTON)) goto fail;
-                    break;
-                    case 'I':
-                        if(sendStatusButtonTogglePacket(MAN_BRIGHT_BUTTON)) goto fail;
-                    break;
-                    case 'N':
-                        if(sendStatusButtonTogglePacket(MAN_CONTRAST_BUTTON)) goto fail;
-                    break;
-                    case 'k':
-                        knobselect = !knobselect;
-                    break;
-                    case 'q':
-                        disconnect = 1;
-                    break;
-                    default:
-                    break;
+                notify("Lost connection to monitor @ %s",m->name);
+            }
+            monitorClose(m);
+            fds[FD_MONITORS + i].fd = -1;
+            knobchanged = 1;
+        }
+    }
+    updateStatusLine();
+    return connectedMonitors() == 0 && !pendingConnects();
+}
+
+// Counters go to the -M file on the way out, whichever mode ran
+int finish(int rc) {
+    FILE *out;
+
+    statsClose(statsFd, statsSpec);
+    captureClose(&wireCapture);
+    if(statusHistory.hdr) historyClose(&statusHistory);
+    freeRules(&statusRules);
+    if(statsDumpPath == NULL) return rc;
+    out = strcmp(statsDumpPath, "-") ? fopen(statsDumpPath, "w") : stdout;
+    if(out == NULL) {
+        fprintf(stderr,"Could not write stats to %s\n",statsDumpPath);
+        return rc;
+    }
+    statsWrite(out, monitors, monitorCount);
+    if(out != stdout) fclose(out);
+    return rc;
+}
+
+int main(int argc , char *argv[])
+{
+    int rc = 0;
+    int disconnect = 0;
+    struct termios ctrl;
+    struct pollfd fds[FD_MONITORS + MAX_MONITORS];
+    struct monitor *m;
+    uint64_t expirations;
+    char input[64];
+    ssize_t n,i;
+    int opt, timeout, t, pending, ever = 0;
+    const char *serverPath = NULL;
+    const char *scriptPath = NULL;
+    struct script script;
+    FILE *scriptFile;
+    const char *snapshotPath = NULL;
+    const char *restorePath = NULL;
+    const char *capturePath = NULL;
+    char *historyPath = NULL;
+    const char *discoverRange = NULL;
+    const char *rulesPath = NULL;
+    int discoverConcurrency = DISCOVER_DEFAULT_CONCURRENCY;
+    int discoverTimeoutMs = DISCOVER_DEFAULT_TIMEOUT_MS;
+    char *colon;
+    uint8_t lineMode = 0;
+    uint16_t preset[STATUS_WORDS];
+
+    while((opt = getopt(argc, argv, "w:t:p:s:d:b:S:L:m:M:c:le:H:D:C:T:R:")) != -1) {
+        switch(opt) {
+            case 'w':
+                knobWindowMs = atoi(optarg);
+            break;
+            case 't':
+                requestTimeoutMs = atoi(optarg);
+            break;
+            case 'p':
+                requestWindow = atoi(optarg);
+                if(requestWindow < 1) requestWindow = 1;
+                if(requestWindow > MONITOR_MAX_QUEUE) requestWindow = MONITOR_MAX_QUEUE;
+            break;
+            case 's':
+                statusPollMs = atoi(optarg);
+            break;
+            case 'd':
+                serverPath = optarg;
+            break;
+            case 'b':
+                scriptPath = optarg;
+            break;
+            case 'S':
+                snapshotPath = optarg;
+            break;
+            case 'L':
+                restorePath = optarg;
+            break;
+            case 'm':
+                statsSpec = optarg;
+            break;
+            case 'M':
+                statsDumpPath = optarg;
+            break;
+            case 'c':
+                capturePath = optarg;
+            break;
+            case 'l':
+                lineMode = 1;
+            break;
+            case 'H':
+                historyPath = optarg;
+            break;
+            case 'D':
+                discoverRange = optarg;
+            break;
+            case 'C':
+                discoverConcurrency = atoi(optarg);
+            break;
+            case 'T':
+                discoverTimeoutMs = atoi(optarg);
+            break;
+            case 'R':
+                rulesPath = optarg;
+            break;
+            case 'e':
+                if(encoderCount == MAX_ENCODERS) {
+                    fprintf(stderr,"At most %d encoders\n",MAX_ENCODERS);
+                    return 1;
                 }
+                if(encoderOpen(&encoders[encoderCount], optarg)) return 1;
+                encoderCount++;
+            break;
+            default:
+                fprintf(stderr,"Usage: %s [-w knob window ms, 0 disables] [-t request timeout ms] [-p requests in flight] [-s fixed status poll ms] [-d serve on unix socket] [-b run script, - for stdin] [-S save preset] [-L restore preset] [-m metrics port or socket] [-M dump metrics on exit] [-c capture wire traffic] [-l status line instead of full screen] [-e encoder device[:AXIS=KNOB,...]] [-H status history file[:records]] [-D discover monitors in a range] [-C connects at once] [-T discovery timeout ms] [-R status rules file] [ip[:port] ...]\n",argv[0]);
+                return 1;
+        }
+    }
+
+    printf("Sony BKM-15R emulator\n");
+    printf("(2022) Martin Hejnfelt (martin@hejnfelt.com)\n");
+    printf("www.immerhax.com\n\n");
+
+    interactive = !(snapshotPath || restorePath || scriptPath || serverPath || discoverRange);
+    autoReconnect = interactive || serverPath;
+    if(capturePath != NULL && captureOpen(&wireCapture, capturePath)) return 1;
+    if(historyPath != NULL) {
+        colon = strrchr(historyPath, ':');
+        if(colon) *colon++ = 0;
+        if(historyOpen(&statusHistory, historyPath, colon ? atoi(colon) : HISTORY_DEFAULT_RECORDS)) return finish(1);
+    }
+    if(rulesPath != NULL) {
+        if(loadRules(rulesPath, &statusRules)) return finish(1);
+        statusRules.onFire = onRule;
+        if(!autoReconnect) fprintf(stderr,"Rules are only followed interactively or while serving\n");
+    }
+    if(statsSpec != NULL) {
+        statsFd = statsListen(statsSpec);
+        if(statsFd < 0) {
+            fprintf(stderr,"Could not listen for metrics on %s\n",statsSpec);
+            return 1;
+        }
+    }
+    if(discoverRange != NULL) {
+        return finish(runDiscovery(discoverRange, discoverConcurrency, discoverTimeoutMs) ? 3 : 0);
+    }
+    if(snapshotPath != NULL) {
+        if(argc - optind > 1) {
+            fprintf(stderr,"A preset is saved from a single monitor\n");
+            return 1;
+        }
+        if(addMonitor(optind == argc ? MONITOR_DEFAULT_IP : argv[optind])) return 2;
+        rc = snapshotPreset(&monitors[0], snapshotPath) ? 3 : 0;
+        monitorClose(&monitors[0]);
+        return finish(rc);
+    }
+
+    // Restoring works on the whole fleet at once
+    if(restorePath != NULL) {
+        if(loadPreset(restorePath, preset)) return 1;
+        if(optind == argc) {
+            addMonitor(MONITOR_DEFAULT_IP);
+        } else {
+            for(i = optind; i < argc; ++i) addMonitor(argv[i]);
+        }
+        if(monitorCount == 0) return 2;
+        rc = restorePreset(monitors, monitorCount, preset) ? 3 : 0;
+        for(i = 0; i < monitorCount; ++i) monitorClose(&monitors[i]);
+        return finish(rc);
+    }
+
+    // Scripts are checked and encoded before anything is connected
+    if(scriptPath != NULL) {
+        if(argc - optind > 1) {
+            fprintf(stderr,"Batch mode only supports a single monitor\n");
+            return 1;
+        }
+        scriptFile = strcmp(scriptPath, "-") ? fopen(scriptPath, "r") : stdin;
+        if(scriptFile == NULL) {
+            fprintf(stderr,"Could not open %s\n",scriptPath);
+            return 1;
+        }
+        rc = compileScript(scriptFile, scriptPath, &script);
+        if(scriptFile != stdin) fclose(scriptFile);
+        if(rc) return 1;
+        if(addMonitor(optind == argc ? MONITOR_DEFAULT_IP : argv[optind])) {
+            freeScript(&script);
+            return 2;
+        }
+        rc = runScript(&monitors[0], &script) ? 3 : 0;
+        monitorClose(&monitors[0]);
+        freeScript(&script);
+        return finish(rc);
+    }
+
+    // As a daemon the one connection is shared by local clients instead
+    if(serverPath != NULL) {
+        if(argc - optind > 1) {
+            fprintf(stderr,"Serving only supports a single monitor\n");
+            return 1;
+        }
+        if(addMonitor(optind == argc ? MONITOR_DEFAULT_IP : argv[optind])) return 2;
+        rc = runServer(&monitors[0], serverPath, statsFd) ? 3 : 0;
+        monitorClose(&monitors[0]);
+        return finish(rc);
+    }
+
+    fcntl(0, F_SETFL, fcntl(0, F_GETFL) | O_NONBLOCK);
+    tcgetattr(STDIN_FILENO, &ctrl);
+    ctrl.c_lflag &= ~ICANON; // make input unbuffered, so enter after keypress isn't needed
+    ctrl.c_lflag &= ~ECHO; // turn off echo so we don't see the keypresses
+    tcsetattr(STDIN_FILENO, TCSANOW, &ctrl);
+
+    // Any addresses given make up the fleet, otherwise it's the one monitor
+    if(optind == argc) {
+        fprintf(stdout,"Connecting to monitor @ %s:%d\n",MONITOR_DEFAULT_IP,MONITOR_PORT);
+        addMonitor(MONITOR_DEFAULT_IP);
+    } else {
+        fprintf(stdout,"Connecting to %d monitor(s)\n",argc - optind);
+        for(i = optind; i < argc; ++i) addMonitor(argv[i]);
+    }
+    if(monitorCount == 0) {
+        fprintf(stderr,"Could not connect");
+        rc = 2;
+        goto close;
+    }
+
+    knobTimerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if(knobTimerfd < 0) {
+        fprintf(stderr,"Could not create knob timer\n");
+        goto fail;
+    }
+
+    fds[FD_INPUT].fd = STDIN_FILENO;
+    fds[FD_INPUT].events = POLLIN;
+    for(i = 0; i < monitorCount; ++i) fds[FD_MONITORS + i].fd = monitors[i].fd;
+    fds[FD_KNOB_TIMER].fd = knobTimerfd;
+    fds[FD_KNOB_TIMER].events = POLLIN;
+    for(i = 0; i < MAX_ENCODERS; ++i) {
+        fds[FD_ENCODERS + i].fd = i < encoderCount ? encoders[i].fd : -1;
+        fds[FD_ENCODERS + i].events = POLLIN;
+    }
+
+    fprintf(stdout,"Starting loop\n");
+    if(!lineMode && isatty(STDOUT_FILENO)) {
+        if(screenOpen(&screen, STDOUT_FILENO)) {
+            fprintf(stderr,"Could not set up the screen\n");
+            goto fail;
+        }
+        signal(SIGWINCH, onResize);
+        dashboard = 1;
+        screenDirty = 1;
+    } else {
+        printKeys();
+    }
+
+    signal(SIGINT, onStop);
+    signal(SIGTERM, onStop);
+    while(!disconnect && !stopRequested) {
+        if(dashboard) redrawDashboard();
+        statsPollFds(statsFd, &fds[FD_STATS]);
+        timeout = statsPollTimeout();
+        for(i = 0; i < monitorCount; ++i) {
+            m = &monitors[i];
+            // the socket changes with every reconnect
+            fds[FD_MONITORS + i].fd = m->fd;
+            if(m->fd < 0 && !m->reconnect) continue;
+            fds[FD_MONITORS + i].events = monitorPollEvents(m);
+            t = monitorPollTimeout(m);
+            if(t >= 0 && (timeout < 0 || t < timeout)) timeout = t;
+        }
+        if(poll(fds, FD_MONITORS + monitorCount, timeout) < 0) {
+            if(errno == EINTR) continue;
+            fprintf(stderr,"Polling failed...\n");
+            goto fail;
+        }
+
+        if(fds[FD_INPUT].revents) {
+            n = read(STDIN_FILENO, input, sizeof(input));
+            if(n == 0) {
+                disconnect = 1;
+            }
+            for(i = 0; i < n && !disconnect; ++i) {
+                if(handleKey(input[i])) disconnect = 1;
+            }
+            updateStatusLine();
+        }
+
+        handleEncoderEvents(fds);
+
+        statsHandleEvents(statsFd, &fds[FD_STATS], monitors, monitorCount);
+
+        if(fds[FD_KNOB_TIMER].revents & POLLIN) {
+            if(read(knobTimerfd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+                knobWindowExpired();
             }
         }
 
-        if(send(sockfd, get_status, sizeof(get_status), 0) < 0)
-	    {
-		    fprintf(stderr,"Sending get status failed...\n");
-		    goto fail;
-	    }
-        if(recv(sockfd,status_response,sizeof(status_response),0) != sizeof(status_response)) {
-		    fprintf(stderr,"Sending get status failed...\n");
-		    goto fail;
+        if(connectedMonitors() > 0) ever = 1;
+        if(handleMonitorEvents(fds)) {
+            rc = ever ? 3 : 2;
+            goto close;
         }
-        statusw1 =  ((status_response[29] - 0x30) << 12) +
-                    ((status_response[30] - 0x30) << 8) +
-                    ((status_response[31] - 0x30) << 4) +
-                    ((status_response[32] - 0x30));
-
-        statusw2 =  ((status_response[34] - 0x30) << 12) +
-                    ((status_response[35] - 0x30) << 8) +
-                    ((status_response[36] - 0x30) << 4) +
-                    ((status_response[37] - 0x30));
-
-        statusw3 =  ((status_response[39] - 0x30) << 12) +
-                    ((status_response[40] - 0x30) << 8) +
-                    ((status_response[41] - 0x30) << 4) +
-                    ((status_response[42] - 0x30));
-
-        statusw4 =  ((status_response[44] - 0x30) << 12) +
-                    ((status_response[45] - 0x30) << 8) +
-                    ((status_response[46] - 0x30) << 4) +
-                    ((status_response[47] - 0x30));
-
-        statusw5 =  ((status_response[49] - 0x30) << 12) +
-                    ((status_response[50] - 0x30) << 8) +
-                    ((status_response[51] - 0x30) << 4) +
-                    ((status_response[52] - 0x30));
-        if(statusw1 & POWER_ON_STATUS) {
-            if(statusw1 != _statusw1 || statusw2 != _statusw2 ||
-                statusw3 != _statusw3 || statusw4 != _statusw4 ||
-                statusw5 != _statusw5 || 1 == knobselect)
-            {        
-                printf("\rStatus: %.04X %.04X %.04X %.04X %.04X",
-                    statusw1,statusw2,statusw3,statusw4,statusw5);
-                if(knobselect) {
-                    printf(" - *P(H)ASE *CH(R)OMA *BR(I)GHT *CO(N)TRAST                   ");
-                } else {
-                    printf(" - ");
-                    if(currentKnob == KNOB_PHASE) printf("*");
-                    printf("PHASE ");
-                    if(currentKnob == KNOB_CHROMA) printf("*");
-                    printf("CHROMA ");
-                    if(currentKnob == KNOB_BRIGHT) printf("*");
-                    printf("BRIGHT ");
-                    if(currentKnob == KNOB_CONTRAST) printf("*");
-                    printf("CONTRAST                    ");
-                }
-                fflush(stdout);
-                _statusw1 = statusw1;
-                _statusw2 = statusw2;
-                _statusw3 = statusw3;
-                _statusw4 = statusw4;
-                _statusw5 = statusw5;
-            } else if(knobchanged) {
-                printf("\rStatus: %.04X %.04X %.04X %.04X %.04X",
-                    statusw1,statusw2,statusw3,statusw4,statusw5);
-                printf(" - ");
-                if(currentKnob == KNOB_PHASE) printf("*");
-                printf("PHASE ");
-                if(currentKnob == KNOB_CHROMA) printf("*");
-                printf("CHROMA ");
-                if(currentKnob == KNOB_BRIGHT) printf("*");
-                printf("BRIGHT ");
-                if(currentKnob == KNOB_CONTRAST) printf("*");
-                printf("CONTRAST                                       ");
-                knobchanged = 0;
-                fflush(stdout);
+    }
+
+    // let whatever is still queued reach the monitor before closing
+    flushKnob();
+    for(;;) {
+        timeout = -1;
+        pending = 0;
+        for(i = 0; i < monitorCount; ++i) {
+            m = &monitors[i];
+            fds[FD_MONITORS + i].fd = m->fd;
+            if(m->fd < 0 || m->count == 0) {
+                fds[FD_MONITORS + i].fd = -1;
+                continue;
             }
-        } else {
-            printf("\rMonitor is powered off...                               \r");
-            fflush(stdout);
+            pending++;
+            fds[FD_MONITORS + i].events = monitorPollEvents(m);
+            t = monitorPollTimeout(m);
+            if(t >= 0 && (timeout < 0 || t < timeout)) timeout = t;
+        }
+        if(pending == 0) break;
+        if(poll(&fds[FD_MONITORS], monitorCount, timeout) < 0 && errno != EINTR) break;
+        for(i = 0; i < monitorCount; ++i) {
+            m = &monitors[i];
+            if(fds[FD_MONITORS + i].fd < 0) continue;
+            if(monitorHandleEvents(m, fds[FD_MONITORS + i].revents)) monitorClose(m);
         }
-        usleep(500*1000);
     }
     goto close;
 
@@ -536,10 +1042,17 @@ fail:
     rc = 3;
 
 close:
+    if(dashboard) {
+        dashboard = 0;
+        screenClose(&screen);
+        if(lastMessage[0] && rc) fprintf(stderr,"%s\n",lastMessage);
+    }
     fprintf(stderr,"\nClosing connection, and exiting...\n");
-    close(sockfd);
+    if(knobTimerfd >= 0) close(knobTimerfd);
+    for(i = 0; i < encoderCount; ++i) encoderClose(&encoders[i]);
+    for(i = 0; i < monitorCount; ++i) monitorClose(&monitors[i]);
     ctrl.c_lflag |= ECHO; // turn echo back on again
     ctrl.c_lflag |= ICANON; // make input buffered again
     tcsetattr(STDIN_FILENO, TCSANOW, &ctrl);
-    return rc;
+    return finish(rc);
 }
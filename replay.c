@@ -0,0 +1,221 @@
+// Plays a wire capture back against a monitor endpoint
+// (2022) Martin Hejnfelt (martin@hejnfelt.com)
+// See https://immerhax.com/?p=797 for more information
+// Licensed under the WTFPL, see LICENSE.txt
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "bkm15r.h"
+#include "monitor.h"
+#include "capture.h"
+
+#define REPLAY_DEFAULT_ADDRESS  "127.0.0.1"
+
+struct replayFrame {
+    uint64_t ns;
+    unsigned stat;
+    uint8_t length;
+    uint8_t data[sizeof(struct frame)];
+};
+
+struct replayRun {
+    uint64_t *latencies;
+    unsigned ok;
+    unsigned errors;
+};
+
+static uint8_t record[UINT16_MAX];
+
+// The stats slot a captured frame belongs to, so it is queued with the
+// right reply kind. Returns STAT_SLOTS for anything unknown.
+static unsigned frameStat(const uint8_t *data, uint8_t length) {
+    const struct frame *f = (const struct frame*)data;
+    unsigned cmd, knob;
+
+    for(cmd = 0; cmd < CMD_COUNT; ++cmd) {
+        if(length == commandLength(cmd) && !memcmp(data, commandData(cmd), length)) return cmd;
+    }
+    if(length > sizeof(header) + strlen(INFO_KNOB) && !memcmp(f->payload, INFO_KNOB " ", strlen(INFO_KNOB) + 1)) {
+        for(knob = 0; knob < KNOB_NONE; ++knob) {
+            if(!strncmp(f->payload + strlen(INFO_KNOB) + 1, knobTargets[knob], strlen(knobTargets[knob]))) {
+                return STAT_KNOB(knob);
+            }
+        }
+    }
+    return STAT_SLOTS;
+}
+
+static void printRecord(const struct captureRecord *rec, const uint8_t *data, uint64_t first) {
+    unsigned i;
+    fprintf(stdout,"%12.6f %s [%u] %3u ",(rec->ns - first) / 1e9,
+        rec->direction == CAPTURE_OUT ? "->" : "<-",rec->channel,rec->length);
+    for(i = 0; i < rec->length; ++i) {
+        fputc(data[i] >= 0x20 && data[i] < 0x7F ? data[i] : '.', stdout);
+    }
+    fputc('\n', stdout);
+}
+
+static void onComplete(struct monitor *mon, const struct request *req, int result) {
+    struct replayRun *run = mon->user;
+    if(result == REQUEST_OK) {
+        run->latencies[run->ok++] = monitorNow() - req->sent;
+    } else {
+        run->errors++;
+    }
+}
+
+static int compareLatency(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[])
+{
+    struct capture cap;
+    struct captureRecord rec;
+    struct replayFrame *frames = NULL, *grown;
+    struct replayRun run;
+    struct monitor mon;
+    struct pollfd pfd;
+    const char *address = REPLAY_DEFAULT_ADDRESS;
+    int port = MONITOR_PORT;
+    int channel = 0, fast = 0, dump = 0, depth = MONITOR_DEFAULT_WINDOW;
+    unsigned count = 0, capacity = 0, next = 0, skipped = 0;
+    uint64_t first = 0, start, now, due;
+    int opt, timeout, t, rc = 0;
+
+    while((opt = getopt(argc, argv, "a:p:c:d:fx")) != -1) {
+        switch(opt) {
+            case 'a':
+                address = optarg;
+            break;
+            case 'p':
+                port = atoi(optarg);
+            break;
+            case 'c':
+                channel = atoi(optarg);
+            break;
+            case 'd':
+                depth = atoi(optarg);
+                if(depth < 1) depth = 1;
+                if(depth > MONITOR_MAX_QUEUE) depth = MONITOR_MAX_QUEUE;
+            break;
+            case 'f':
+                fast = 1;
+            break;
+            case 'x':
+                dump = 1;
+            break;
+            default:
+                goto usage;
+        }
+    }
+    if(optind != argc - 1) goto usage;
+    if(captureOpenRead(&cap, argv[optind])) return 1;
+
+    // everything is loaded up front, nothing is read from disk while replaying
+    while(!captureRead(&cap, &rec, record)) {
+        if(first == 0) first = rec.ns;
+        if(dump) {
+            printRecord(&rec, record, first);
+            continue;
+        }
+        if(rec.direction != CAPTURE_OUT || rec.channel != channel) continue;
+        if(rec.length > sizeof(struct frame) || frameStat(record, rec.length) == STAT_SLOTS) {
+            skipped++;
+            continue;
+        }
+        if(count == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            grown = realloc(frames, capacity * sizeof(struct replayFrame));
+            if(grown == NULL) {
+                fprintf(stderr,"Out of memory\n");
+                rc = 1;
+                goto close;
+            }
+            frames = grown;
+        }
+        frames[count].ns = rec.ns;
+        frames[count].stat = frameStat(record, rec.length);
+        frames[count].length = rec.length;
+        memcpy(frames[count].data, record, rec.length);
+        count++;
+    }
+    if(dump) goto close;
+    if(skipped) fprintf(stderr,"Skipped %u unknown frame(s)\n",skipped);
+    if(count == 0) {
+        fprintf(stderr,"No frames sent on channel %d in the capture\n",channel);
+        rc = 1;
+        goto close;
+    }
+
+    memset(&run, 0, sizeof(run));
+    run.latencies = calloc(count, sizeof(uint64_t));
+    if(run.latencies == NULL) {
+        rc = 1;
+        goto close;
+    }
+    monitorInit(&mon);
+    mon.window = depth;
+    mon.user = &run;
+    mon.onComplete = onComplete;
+    if(monitorConnect(&mon, address, port)) {
+        fprintf(stderr,"Could not connect to %s:%d\n",address,port);
+        free(run.latencies);
+        rc = 2;
+        goto close;
+    }
+
+    start = monitorNow();
+    pfd.fd = mon.fd;
+    while(next < count || mon.count > 0) {
+        now = monitorNow();
+        while(next < count && mon.count < MONITOR_MAX_QUEUE) {
+            // at the original pace, frames go out as far apart as they were captured
+            due = start + (frames[next].ns - frames[0].ns);
+            if(!fast && due > now) break;
+            monitorFrame(&mon, frames[next].stat, frames[next].data, frames[next].length, statsSlotName(frames[next].stat), NULL);
+            next++;
+        }
+        timeout = monitorPollTimeout(&mon);
+        if(!fast && next < count) {
+            due = start + (frames[next].ns - frames[0].ns);
+            t = due <= now ? 0 : (int)((due - now + 999999) / 1000000);
+            if(timeout < 0 || t < timeout) timeout = t;
+        }
+        pfd.events = monitorPollEvents(&mon);
+        if(poll(&pfd, 1, timeout) < 0 && errno != EINTR) break;
+        if(monitorHandleEvents(&mon, pfd.revents)) {
+            fprintf(stderr,"Lost connection after %u of %u frames\n",next,count);
+            rc = 3;
+            break;
+        }
+    }
+    now = monitorNow();
+
+    qsort(run.latencies, run.ok, sizeof(uint64_t), compareLatency);
+    fprintf(stdout,"{\"frames\":%u,\"errors\":%u,\"mode\":\"%s\",\"captured_ms\":%.1f,\"replayed_ms\":%.1f,"
+                   "\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}\n",
+        count, run.errors, fast ? "fast" : "realtime",
+        (frames[count - 1].ns - frames[0].ns) / 1e6, (now - start) / 1e6,
+        run.ok ? run.latencies[run.ok / 2] / 1000.0 : 0.0,
+        run.ok ? run.latencies[(run.ok * 99) / 100] / 1000.0 : 0.0,
+        run.ok ? run.latencies[run.ok - 1] / 1000.0 : 0.0);
+    if(run.errors && rc == 0) rc = 3;
+    monitorClose(&mon);
+    free(run.latencies);
+
+close:
+    free(frames);
+    captureClose(&cap);
+    return rc;
+
+usage:
+    fprintf(stderr,"Usage: %s [-a address] [-p port] [-c channel] [-d depth] [-f as fast as possible] [-x print capture] capture\n",argv[0]);
+    return 1;
+}
@@ -0,0 +1,189 @@
+// Status rules, commands sent as soon as a status flag changes
+// (2022) Martin Hejnfelt (martin@hejnfelt.com)
+// See https://immerhax.com/?p=797 for more information
+// Licensed under the WTFPL, see LICENSE.txt
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "bkm15r.h"
+#include "monitor.h"
+#include "script.h"
+#include "rules.h"
+
+#define RULES_LINE_SIZE     (512)
+
+_Static_assert(RULES_MAX <= 32, "held off rules are kept one bit each in 32 bits");
+
+// The commands are compiled the same way as a script, so they are encoded
+// frames by the time a rule fires
+static int compileActions(char *text, const char *source, unsigned line, struct rule *rule) {
+    char where[RULES_LINE_SIZE];
+    struct script actions;
+    unsigned i;
+    FILE *in;
+    int rc;
+
+    snprintf(where, sizeof(where), "%s:%u", source, line);
+    in = fmemopen(text, strlen(text), "r");
+    if(in == NULL) {
+        fprintf(stderr,"%s: out of memory\n",where);
+        return 1;
+    }
+    rc = compileScript(in, where, &actions);
+    fclose(in);
+    if(rc) return 1;
+    if(actions.count == 0) {
+        fprintf(stderr,"%s: no commands\n",where);
+        goto fail;
+    }
+    for(i = 0; i < actions.count; ++i) {
+        if(actions.steps[i].kind == STEP_WAIT) {
+            fprintf(stderr,"%s: a rule can't wait, its commands are sent at once\n",where);
+            goto fail;
+        }
+    }
+    rule->actions = actions.steps;
+    rule->actionCount = actions.count;
+    return 0;
+
+fail:
+    freeScript(&actions);
+    return 1;
+}
+
+int loadRules(const char *path, struct rules *rules) {
+    char text[RULES_LINE_SIZE];
+    char *comment, *colon, *flag, *edge, *extra, *save;
+    const struct statusButton *b = NULL;
+    struct rule *rule;
+    unsigned line = 0, i, len;
+    FILE *f;
+
+    memset(rules, 0, sizeof(*rules));
+    f = fopen(path, "r");
+    if(f == NULL) {
+        fprintf(stderr,"Could not open rules %s\n",path);
+        return 1;
+    }
+    while(fgets(text, sizeof(text), f) != NULL) {
+        line++;
+        comment = strchr(text, '#');
+        if(comment) *comment = 0;
+        len = strlen(text);
+        while(len > 0 && strchr(" \t\r\n", text[len - 1])) text[--len] = 0;
+        if(strspn(text, " \t") == len) continue;
+
+        colon = strchr(text, ':');
+        if(colon == NULL) {
+            fprintf(stderr,"%s:%u: expected <flag> on|off|changes: <commands>\n",path,line);
+            goto fail;
+        }
+        if(rules->count == RULES_MAX) {
+            fprintf(stderr,"%s:%u: at most %d rules\n",path,line,RULES_MAX);
+            goto fail;
+        }
+        rule = &rules->rules[rules->count];
+        memset(rule, 0, sizeof(*rule));
+        rule->line = line;
+        snprintf(rule->text, sizeof(rule->text), "%s", text + strspn(text, " \t"));
+
+        *colon = 0;
+        save = NULL;
+        flag = strtok_r(text, " \t", &save);
+        edge = strtok_r(NULL, " \t", &save);
+        extra = strtok_r(NULL, " \t", &save);
+        for(i = 0; flag && i < STATUS_BUTTON_COUNT; ++i) {
+            b = &statusButtons[i];
+            if(!strcasecmp(b->name, flag)) break;
+        }
+        if(flag == NULL || i == STATUS_BUTTON_COUNT) {
+            fprintf(stderr,"%s:%u: unknown flag %s\n",path,line,flag ? flag : "");
+            goto fail;
+        }
+        rule->word = b->word;
+        rule->mask = b->mask;
+        rule->anyPower = b->word == 0 && b->mask == POWER_ON_STATUS;
+        if(edge != NULL && extra == NULL && !strcasecmp(edge, "on")) {
+            rule->care = rule->value = b->mask;
+        } else if(edge != NULL && extra == NULL && !strcasecmp(edge, "off")) {
+            rule->care = b->mask;
+        } else if(edge == NULL || extra != NULL || strcasecmp(edge, "changes")) {
+            fprintf(stderr,"%s:%u: %s goes on, off or changes\n",path,line,b->name);
+            goto fail;
+        }
+        if(compileActions(colon + 1, path, line, rule)) goto fail;
+        rules->watch[rule->word] |= rule->mask;
+        rules->count++;
+    }
+    fclose(f);
+    if(rules->count == 0) fprintf(stderr,"No rules in %s\n",path);
+    return 0;
+
+fail:
+    fclose(f);
+    freeRules(rules);
+    return 1;
+}
+
+void freeRules(struct rules *rules) {
+    unsigned i;
+    for(i = 0; i < rules->count; ++i) free(rules->rules[i].actions);
+    memset(rules, 0, sizeof(*rules));
+}
+
+static int fire(const struct rule *rule, struct monitor *mon) {
+    const struct step *step;
+    unsigned i;
+
+    for(i = 0; i < rule->actionCount; ++i) {
+        step = &rule->actions[i];
+        if(monitorFrame(mon, step->stat, step->data, step->length, step->name, NULL)) return RULE_QUEUE_FULL;
+    }
+    return RULE_FIRED;
+}
+
+void evaluateRules(const struct rules *rules, struct monitor *mon, const uint16_t *status) {
+    struct ruleState *state = &mon->ruleState;
+    const struct rule *rule;
+    uint16_t changed[STATUS_WORDS], any = 0;
+    uint64_t now = 0;
+    uint8_t valid = state->valid, held;
+    unsigned i;
+    int result;
+
+    for(i = 0; i < STATUS_WORDS; ++i) {
+        changed[i] = (status[i] ^ state->last[i]) & rules->watch[i];
+        any |= changed[i];
+    }
+    memcpy(state->last, status, sizeof(state->last));
+    state->valid = 1;
+    if(!valid || !(any || state->heldOff)) return;
+
+    for(i = 0; i < rules->count; ++i) {
+        rule = &rules->rules[i];
+        held = (state->heldOff >> i) & 1;
+        if(!held && !(changed[rule->word] & rule->mask)) continue;
+        // a powered off monitor only listens to the power button
+        if((status[rule->word] & rule->care) != rule->value ||
+            (!rule->anyPower && !(status[0] & POWER_ON_STATUS)))
+        {
+            state->heldOff &= ~(1U << i);
+            continue;
+        }
+        if(now == 0) now = monitorNow();
+        if(now < state->quietUntil[i]) {
+            state->heldOff |= 1U << i;
+            // reported when it's held off, not with every status after
+            if(held) continue;
+            result = RULE_HELD_OFF;
+        } else {
+            state->heldOff &= ~(1U << i);
+            state->quietUntil[i] = now + (uint64_t)RULE_HOLDOFF_MS * 1000000ULL;
+            result = fire(rule, mon);
+        }
+        if(rules->onFire) rules->onFire(mon, rule, result);
+    }
+}
@@ -0,0 +1,75 @@
+// Status rules, commands sent as soon as a status flag changes
+// (2022) Martin Hejnfelt (martin@hejnfelt.com)
+// See https://immerhax.com/?p=797 for more information
+// Licensed under the WTFPL, see LICENSE.txt
+
+#ifndef RULES_H
+#define RULES_H
+
+#include <stdint.h>
+
+#include "bkm15r.h"
+
+#define RULES_MAX           (32)
+#define RULE_TEXT_SIZE      (64)
+// A rule fires at most this often per monitor, so two rules, or a rule and
+// a monitor that won't keep the flag, can't toggle it back and forth
+#define RULE_HOLDOFF_MS     (1000)
+
+struct monitor;
+struct step;
+
+enum RuleResult {
+    RULE_FIRED,
+    RULE_HELD_OFF,      // fired too recently, fires once the time is up
+    RULE_QUEUE_FULL     // not all of the commands could be queued
+};
+
+// What each monitor keeps for the rules, the status they last looked at
+// survives a reconnect, so a monitor coming back changed still counts
+struct ruleState {
+    uint16_t last[STATUS_WORDS];
+    uint8_t valid;
+    uint64_t quietUntil[RULES_MAX];     // ns, monotonic
+    uint32_t heldOff;                   // rules to fire once quiet, one bit each
+};
+
+// Matching is a mask check on the changed bits of one status word, and
+// for "on" and "off" a compare against what the bit became
+struct rule {
+    uint8_t word;
+    uint16_t mask;
+    uint16_t care;      // mask, or 0 when any change will do
+    uint16_t value;     // what the bit has to be after the change
+    uint8_t anyPower;   // acts on a powered off monitor too, only for POWER
+    struct step *actions;   // compiled like a script
+    unsigned actionCount;
+    unsigned line;
+    char text[RULE_TEXT_SIZE];
+};
+
+struct rules {
+    struct rule rules[RULES_MAX];
+    unsigned count;
+    uint16_t watch[STATUS_WORDS];   // every bit some rule looks at
+    void (*onFire)(struct monitor *mon, const struct rule *rule, int result);
+};
+
+// A rules file has one rule per line, # starts a comment:
+//   <flag> on|off|changes: <commands>
+// flag is any status flag by name (POWER, EXTSYNC, COMB, ...) and commands
+// are what a script takes, except wait, e.g.
+//   EXTSYNC off: EXTSYNC
+//   POWER on: DEGAUSS 3 ENTER
+// Returns 0 on success, 1 with the offending line reported on stderr.
+int loadRules(const char *path, struct rules *rules);
+void freeRules(struct rules *rules);
+
+// Called with every status reply. Compares it to what the monitor had
+// before and queues the commands of every rule the change matches, which
+// go on the wire right away. The first status a monitor ever reports is
+// only taken note of. A rule that was held off fires with the first status
+// after its holdoff in which the flag is still what it changed to.
+void evaluateRules(const struct rules *rules, struct monitor *mon, const uint16_t *status);
+
+#endif
@@ -0,0 +1,159 @@
+// Full screen terminal output, repainting only the cells that changed
+// (2022) Martin Hejnfelt (martin@hejnfelt.com)
+// See https://immerhax.com/?p=797 for more information
+// Licensed under the WTFPL, see LICENSE.txt
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+
+#include "screen.h"
+
+#define SCREEN_ENTER        "\033[?1049h\033[?25l"
+#define SCREEN_LEAVE        "\033[0m\033[?25h\033[?1049l"
+// Cursor move, attribute change and the character itself
+#define SCREEN_CELL_MAX     (16)
+// A cursor move takes at least 6 bytes
+#define SCREEN_GAP_MAX      (4)
+
+static const char *attrCodes[] = {
+    [ATTR_NORMAL]   = "\033[0m",
+    [ATTR_BOLD]     = "\033[0;1m",
+    [ATTR_REVERSE]  = "\033[0;7m"
+};
+
+static void writeAll(int fd, const char *buf, size_t length) {
+    ssize_t n;
+    while(length > 0) {
+        n = write(fd, buf, length);
+        if(n < 0) {
+            if(errno == EINTR || errno == EAGAIN) continue;
+            return;
+        }
+        buf += n;
+        length -= n;
+    }
+}
+
+static void fill(struct cell *cells, int count, char ch) {
+    int i;
+    for(i = 0; i < count; ++i) {
+        cells[i].ch = ch;
+        cells[i].attr = ATTR_NORMAL;
+    }
+}
+
+int screenResize(struct screen *s) {
+    struct winsize ws;
+    int rows = 24, cols = 80;
+    struct cell *front, *back;
+    char *out;
+
+    if(ioctl(s->fd, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 0 && ws.ws_col > 0) {
+        rows = ws.ws_row;
+        cols = ws.ws_col;
+    }
+    front = realloc(s->front, rows * cols * sizeof(struct cell));
+    if(front == NULL) return 1;
+    s->front = front;
+    back = realloc(s->back, rows * cols * sizeof(struct cell));
+    if(back == NULL) return 1;
+    s->back = back;
+    out = realloc(s->out, rows * cols * SCREEN_CELL_MAX + 16);
+    if(out == NULL) return 1;
+    s->out = out;
+    s->outSize = rows * cols * SCREEN_CELL_MAX + 16;
+    s->rows = rows;
+    s->cols = cols;
+
+    // the terminal is cleared, so only what is drawn next goes out
+    writeAll(s->fd, "\033[0m\033[2J", 8);
+    fill(s->front, rows * cols, ' ');
+    fill(s->back, rows * cols, ' ');
+    return 0;
+}
+
+int screenOpen(struct screen *s, int fd) {
+    memset(s, 0, sizeof(*s));
+    s->fd = fd;
+    writeAll(fd, SCREEN_ENTER, strlen(SCREEN_ENTER));
+    return screenResize(s);
+}
+
+void screenClose(struct screen *s) {
+    if(s->front == NULL) return;
+    writeAll(s->fd, SCREEN_LEAVE, strlen(SCREEN_LEAVE));
+    free(s->front);
+    free(s->back);
+    free(s->out);
+    memset(s, 0, sizeof(*s));
+}
+
+void screenClear(struct screen *s) {
+    fill(s->back, s->rows * s->cols, ' ');
+}
+
+int screenText(struct screen *s, int row, int col, uint8_t attr, const char *fmt, ...) {
+    char text[256];
+    struct cell *c;
+    va_list args;
+    int i, n;
+
+    if(row < 0 || row >= s->rows) return col;
+    va_start(args, fmt);
+    n = vsnprintf(text, sizeof(text), fmt, args);
+    va_end(args);
+    if(n < 0) return col;
+    if(n >= (int)sizeof(text)) n = sizeof(text) - 1;
+    for(i = 0; i < n && col < s->cols; ++i, ++col) {
+        if(col < 0) continue;
+        c = &s->back[row * s->cols + col];
+        c->ch = text[i];
+        c->attr = attr;
+    }
+    return col;
+}
+
+static uint8_t sameAttr(const struct screen *s, int row, int from, int to, uint8_t attr) {
+    for(; from < to; ++from) {
+        if(s->back[row * s->cols + from].attr != attr) return 0;
+    }
+    return 1;
+}
+
+size_t screenFlush(struct screen *s) {
+    struct cell *front, *back;
+    char *p = s->out;
+    int row, col, cursorRow = -1, cursorCol = -1;
+    uint8_t attr = 0xFF;
+
+    for(row = 0; row < s->rows; ++row) {
+        for(col = 0; col < s->cols; ++col) {
+            front = &s->front[row * s->cols + col];
+            back = &s->back[row * s->cols + col];
+            if(front->ch == back->ch && front->attr == back->attr) continue;
+            // runs of changed cells need a single cursor move, and short
+            // gaps in a run are cheaper to write again than to jump over
+            if(row == cursorRow && col > cursorCol && col - cursorCol <= SCREEN_GAP_MAX && sameAttr(s, row, cursorCol, col, attr)) {
+                for(; cursorCol < col; ++cursorCol) *p++ = s->back[row * s->cols + cursorCol].ch;
+            } else if(row != cursorRow || col != cursorCol) {
+                p += sprintf(p, "\033[%d;%dH", row + 1, col + 1);
+            }
+            if(back->attr != attr) {
+                attr = back->attr;
+                p += sprintf(p, "%s", attrCodes[attr]);
+            }
+            *p++ = back->ch;
+            *front = *back;
+            cursorRow = row;
+            cursorCol = col + 1;
+        }
+    }
+    if(p == s->out) return 0;
+    writeAll(s->fd, s->out, p - s->out);
+    return p - s->out;
+}
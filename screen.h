@@ -0,0 +1,47 @@
+// Full screen terminal output, repainting only the cells that changed
+// (2022) Martin Hejnfelt (martin@hejnfelt.com)
+// See https://immerhax.com/?p=797 for more information
+// Licensed under the WTFPL, see LICENSE.txt
+
+#ifndef SCREEN_H
+#define SCREEN_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+enum CellAttr {
+    ATTR_NORMAL,
+    ATTR_BOLD,
+    ATTR_REVERSE
+};
+
+struct cell {
+    char ch;
+    uint8_t attr;   // enum CellAttr
+};
+
+// Drawing goes into back, flushing sends whatever differs from front (what
+// the terminal shows) as one write and makes the two equal again
+struct screen {
+    int fd;
+    int rows;
+    int cols;
+    struct cell *front;
+    struct cell *back;
+    char *out;
+    size_t outSize;
+};
+
+// Switches the terminal on fd to the alternate screen, 0 on success
+int screenOpen(struct screen *s, int fd);
+// Picks up a new terminal size, everything is repainted on the next flush
+int screenResize(struct screen *s);
+void screenClose(struct screen *s);
+
+void screenClear(struct screen *s);
+// Writes text at row, col, clipped at the edge. Returns the column after it.
+int screenText(struct screen *s, int row, int col, uint8_t attr, const char *fmt, ...) __attribute__((format(printf, 5, 6)));
+// Returns the number of bytes written to the terminal
+size_t screenFlush(struct screen *s);
+
+#endif
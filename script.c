@@ -0,0 +1,207 @@
+// Batch mode, command scripts compiled to frames and run at wire speed
+// (2022) Martin Hejnfelt (martin@hejnfelt.com)
+// See https://immerhax.com/?p=797 for more information
+// Licensed under the WTFPL, see LICENSE.txt
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "bkm15r.h"
+#include "protocol.h"
+#include "script.h"
+
+#define SCRIPT_LINE_SIZE    (512)
+#define SCRIPT_MAX_TICKS    (255)
+
+static struct step* addStep(struct script *script, uint8_t kind, unsigned line) {
+    struct step *steps;
+    unsigned capacity;
+
+    if(script->count == script->capacity) {
+        capacity = script->capacity ? script->capacity * 2 : 64;
+        steps = realloc(script->steps, capacity * sizeof(struct step));
+        if(steps == NULL) return NULL;
+        script->steps = steps;
+        script->capacity = capacity;
+    }
+    memset(&script->steps[script->count], 0, sizeof(struct step));
+    script->steps[script->count].kind = kind;
+    script->steps[script->count].line = line;
+    return &script->steps[script->count++];
+}
+
+// Knob turns beyond what one frame can carry become several frames
+static int addKnob(struct script *script, enum Knobs knob, long ticks, unsigned line) {
+    struct step *step;
+    int8_t dir = ticks < 0 ? -1 : 1;
+    unsigned n;
+
+    ticks = labs(ticks);
+    while(ticks > 0) {
+        n = ticks > SCRIPT_MAX_TICKS ? SCRIPT_MAX_TICKS : ticks;
+        step = addStep(script, STEP_FRAME, line);
+        if(step == NULL) return 1;
+        step->stat = STAT_KNOB(knob);
+        step->name = knobTargets[knob];
+        step->length = encodeKnobFrame(step->frame, knobTargets[knob], dir, n);
+        if(step->length == 0) return 1;
+        ticks -= n;
+    }
+    return 0;
+}
+
+int compileScript(FILE *in, const char *source, struct script *script) {
+    char text[SCRIPT_LINE_SIZE];
+    char *word, *arg, *end, *comment, *save;
+    enum Command cmd;
+    enum Knobs knob;
+    struct step *step;
+    unsigned line = 0, i;
+    long value;
+
+    memset(script, 0, sizeof(*script));
+    while(fgets(text, sizeof(text), in) != NULL) {
+        line++;
+        comment = strchr(text, '#');
+        if(comment) *comment = 0;
+        save = NULL;
+        for(word = strtok_r(text, " \t\r\n", &save); word; word = strtok_r(NULL, " \t\r\n", &save)) {
+            if(!strcasecmp(word, "knob")) {
+                arg = strtok_r(NULL, " \t\r\n", &save);
+                knob = arg ? knobByName(arg) : KNOB_NONE;
+                if(knob == KNOB_NONE) {
+                    fprintf(stderr,"%s:%u: unknown knob %s\n",source,line,arg ? arg : "");
+                    goto fail;
+                }
+                arg = strtok_r(NULL, " \t\r\n", &save);
+                value = arg ? strtol(arg, &end, 10) : 0;
+                if(arg == NULL || *end || value == 0 || labs(value) > 100000) {
+                    fprintf(stderr,"%s:%u: bad tick count for knob %s\n",source,line,knobNames[knob]);
+                    goto fail;
+                }
+                if(addKnob(script, knob, value, line)) goto nomem;
+            } else if(!strcasecmp(word, "wait")) {
+                arg = strtok_r(NULL, " \t\r\n", &save);
+                value = arg ? strtol(arg, &end, 10) : -1;
+                if(arg == NULL || *end || value < 0) {
+                    fprintf(stderr,"%s:%u: bad wait time\n",source,line);
+                    goto fail;
+                }
+                step = addStep(script, STEP_WAIT, line);
+                if(step == NULL) goto nomem;
+                step->waitMs = value;
+            } else {
+                cmd = commandByName(word);
+                // status reads don't belong in a script, there's nothing to act on
+                if(cmd == CMD_COUNT || cmd == CMD_STATUS_GET) {
+                    fprintf(stderr,"%s:%u: unknown command %s\n",source,line,word);
+                    goto fail;
+                }
+                step = addStep(script, STEP_FRAME, line);
+                if(step == NULL) goto nomem;
+                step->stat = cmd;
+                step->name = commands[cmd].name;
+                step->data = commandData(cmd);
+                step->length = commandLength(cmd);
+            }
+        }
+    }
+    // the array is done moving, point knob steps at their own frames
+    for(i = 0; i < script->count; ++i) {
+        if(script->steps[i].kind == STEP_FRAME && script->steps[i].data == NULL) {
+            script->steps[i].data = script->steps[i].frame;
+        }
+    }
+    return 0;
+
+nomem:
+    fprintf(stderr,"%s:%u: out of memory\n",source,line);
+fail:
+    freeScript(script);
+    return 1;
+}
+
+void freeScript(struct script *script) {
+    free(script->steps);
+    memset(script, 0, sizeof(*script));
+}
+
+static const struct step *failedStep;
+static int failedResult;
+
+static void onScriptComplete(struct monitor *mon, const struct request *req, int result) {
+    (void)mon;
+    if(result == REQUEST_OK || failedStep != NULL) return;
+    failedStep = req->tag;
+    failedResult = result;
+}
+
+int runScript(struct monitor *mon, const struct script *script) {
+    const struct step *step;
+    struct pollfd pfd;
+    unsigned next = 0, frames = 0;
+    uint64_t start = 0, now, waitUntil = 0;
+    int timeout, t;
+
+    failedStep = NULL;
+    mon->onComplete = onScriptComplete;
+    mon->onStatus = NULL;
+    // nothing but the script goes on the wire
+    mon->autoPoll = 0;
+
+    for(;;) {
+        now = monitorNow();
+        if(!mon->connecting && mon->fd >= 0 && start == 0) start = now;
+        while(start && failedStep == NULL && next < script->count) {
+            step = &script->steps[next];
+            if(step->kind == STEP_WAIT) {
+                // waits are relative to everything before them being done
+                if(mon->count > 0) break;
+                if(waitUntil == 0) waitUntil = now + (uint64_t)step->waitMs * 1000000ULL;
+                if(now < waitUntil) break;
+                waitUntil = 0;
+                next++;
+                continue;
+            }
+            if(mon->count == MONITOR_MAX_QUEUE) break;
+            if(monitorFrame(mon, step->stat, step->data, step->length, step->name, (void*)step)) break;
+            frames++;
+            next++;
+        }
+        if(mon->count == 0 && (failedStep != NULL || next == script->count)) break;
+
+        timeout = monitorPollTimeout(mon);
+        if(waitUntil) {
+            t = waitUntil <= now ? 0 : (int)((waitUntil - now + 999999) / 1000000);
+            if(timeout < 0 || t < timeout) timeout = t;
+        }
+        pfd.fd = mon->fd;
+        pfd.events = monitorPollEvents(mon);
+        if(poll(&pfd, 1, timeout) < 0) {
+            if(errno == EINTR) continue;
+            fprintf(stderr,"Polling failed...\n");
+            return 1;
+        }
+        if(monitorHandleEvents(mon, pfd.revents)) {
+            if(start == 0) {
+                fprintf(stderr,"Could not connect to monitor @ %s\n",mon->name);
+                return 1;
+            }
+            fprintf(stderr,"Lost connection to monitor @ %s after %u of %u steps\n",mon->name,next,script->count);
+            return 1;
+        }
+    }
+
+    now = monitorNow();
+    if(failedStep != NULL) {
+        fprintf(stderr,"Line %u: %s %s, stopped\n",failedStep->line,failedStep->name,
+            failedResult == REQUEST_TIMEOUT ? "timed out" : "failed");
+        return 1;
+    }
+    fprintf(stdout,"Ran %u frames in %.3f ms\n",frames,(now - start) / 1e6);
+    return 0;
+}
@@ -0,0 +1,49 @@
+// Batch mode, command scripts compiled to frames and run at wire speed
+// (2022) Martin Hejnfelt (martin@hejnfelt.com)
+// See https://immerhax.com/?p=797 for more information
+// Licensed under the WTFPL, see LICENSE.txt
+
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include <stdio.h>
+
+#include "monitor.h"
+
+enum StepKind {
+    STEP_FRAME,
+    STEP_WAIT
+};
+
+struct step {
+    uint8_t kind;           // enum StepKind
+    uint8_t stat;           // command or STAT_KNOB(knob)
+    uint8_t length;
+    const uint8_t *data;    // frame from the command table, or frame below
+    uint8_t frame[sizeof(struct frame)];
+    const char *name;
+    unsigned waitMs;
+    unsigned line;
+};
+
+struct script {
+    struct step *steps;
+    unsigned count;
+    unsigned capacity;
+};
+
+// A script is whitespace separated words, # starts a comment:
+//   <command>            any command by name, e.g. POWER, COMB, MENUDOWN, 5
+//   knob <knob> <ticks>  PHASE, CHROMA, BRIGHT or CONTRAST, signed ticks
+//   wait <ms>            let everything before it complete, then pause
+// All frames are encoded up front. Returns 0 on success, 1 with the
+// offending line reported on stderr otherwise.
+int compileScript(FILE *in, const char *source, struct script *script);
+void freeScript(struct script *script);
+
+// Runs the script against mon, keeping as many frames in flight as the
+// monitor's window allows and stopping at the first failed step.
+// Returns 0 if every step was acknowledged.
+int runScript(struct monitor *mon, const struct script *script);
+
+#endif
@@ -0,0 +1,288 @@
+// Shared-connection daemon serving local clients over a Unix socket
+// (2022) Martin Hejnfelt (martin@hejnfelt.com)
+// See https://immerhax.com/?p=797 for more information
+// Licensed under the WTFPL, see LICENSE.txt
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+
+#include "bkm15r.h"
+#include "protocol.h"
+#include "server.h"
+#include "stats.h"
+
+struct client {
+    int fd;
+    uint8_t watching;
+    char in[SERVER_LINE_SIZE];
+    size_t inLength;
+    char out[SERVER_OUT_SIZE];
+    size_t outLength;
+};
+
+static struct client clients[SERVER_MAX_CLIENTS];
+static struct monitor *served;
+static volatile sig_atomic_t stopServer = 0;
+
+static void onServerSignal(int sig) {
+    (void)sig;
+    stopServer = 1;
+}
+
+static void dropClient(struct client *c) {
+    unsigned i;
+    // replies still on their way must not reach whoever gets this slot next
+    for(i = 0; i < served->count; ++i) {
+        struct request *req = &served->queue[(served->head + i) % MONITOR_MAX_QUEUE];
+        if(req->tag == c) req->tag = NULL;
+    }
+    close(c->fd);
+    c->fd = -1;
+}
+
+// Output is buffered per client and flushed from the loop. A client that
+// doesn't keep up with it gets dropped rather than holding up the others.
+static void reply(struct client *c, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void reply(struct client *c, const char *fmt, ...) {
+    va_list args;
+    int n;
+
+    if(c->fd < 0) return;
+    va_start(args, fmt);
+    n = vsnprintf(c->out + c->outLength, sizeof(c->out) - c->outLength, fmt, args);
+    va_end(args);
+    if(n < 0 || (size_t)n >= sizeof(c->out) - c->outLength) {
+        dropClient(c);
+        return;
+    }
+    c->outLength += n;
+}
+
+static void replyStatus(struct client *c) {
+    const uint16_t *s = served->status;
+    if(!served->statusValid) {
+        reply(c, "status unknown\n");
+        return;
+    }
+    reply(c, "status %.04X %.04X %.04X %.04X %.04X\n",s[0],s[1],s[2],s[3],s[4]);
+}
+
+static void onServerStatus(struct monitor *mon) {
+    static uint16_t last[STATUS_WORDS];
+    static uint8_t lastValid = 0;
+    int i;
+
+    if(lastValid && !memcmp(last, mon->status, sizeof(last))) return;
+    memcpy(last, mon->status, sizeof(last));
+    lastValid = 1;
+    for(i = 0; i < SERVER_MAX_CLIENTS; ++i) {
+        if(clients[i].fd >= 0 && clients[i].watching) replyStatus(&clients[i]);
+    }
+}
+
+static void onServerComplete(struct monitor *mon, const struct request *req, int result) {
+    struct client *c = req->tag;
+    (void)mon;
+    if(c == NULL) return;
+    if(result == REQUEST_OK) {
+        reply(c, "ok %s\n",req->name);
+    } else {
+        reply(c, "error %s %s\n",req->name,result == REQUEST_TIMEOUT ? "timeout" : "failed");
+    }
+}
+
+static void handleLine(struct client *c, char *line) {
+    char *verb, *arg, *ticks, *end, *save = NULL;
+    enum Command cmd;
+    enum Knobs knob;
+    long n;
+
+    verb = strtok_r(line, " \t\r", &save);
+    arg = strtok_r(NULL, " \t\r", &save);
+    if(verb == NULL) return;
+
+    if(!strcasecmp(verb, "status")) {
+        replyStatus(c);
+    } else if(!strcasecmp(verb, "watch")) {
+        c->watching = 1;
+        reply(c, "ok watch\n");
+        replyStatus(c);
+    } else if(!strcasecmp(verb, "send")) {
+        cmd = arg ? commandByName(arg) : CMD_COUNT;
+        // status requests are the daemon's business, clients get the cache
+        if(cmd == CMD_COUNT || cmd == CMD_STATUS_GET) {
+            reply(c, "error %s unknown\n",arg ? arg : "-");
+        } else if(monitorCommand(served, cmd, c)) {
+            reply(c, "error %s busy\n",arg);
+        }
+    } else if(!strcasecmp(verb, "knob")) {
+        ticks = strtok_r(NULL, " \t\r", &save);
+        knob = arg ? knobByName(arg) : KNOB_NONE;
+        errno = 0;
+        n = ticks ? strtol(ticks, &end, 10) : 0;
+        if(knob == KNOB_NONE) {
+            reply(c, "error %s invalid\n",arg ? arg : "-");
+        } else if(ticks == NULL || *end || errno || n == 0 || labs(n) > SERVER_MAX_TICKS) {
+            // one knob packet carries at most SERVER_MAX_TICKS either way
+            reply(c, "error %s ticks %s invalid\n",arg,ticks ? ticks : "-");
+        } else if(monitorKnob(served, knob, n > 0 ? 1 : -1, labs(n), c)) {
+            reply(c, "error %s busy\n",arg);
+        }
+    } else if(!strcasecmp(verb, "quit")) {
+        dropClient(c);
+    } else {
+        reply(c, "error %s unknown\n",verb);
+    }
+}
+
+static void readClient(struct client *c) {
+    char *newline;
+    size_t lineLength;
+    ssize_t n;
+
+    n = recv(c->fd, c->in + c->inLength, sizeof(c->in) - 1 - c->inLength, MSG_DONTWAIT);
+    if(n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+        dropClient(c);
+        return;
+    }
+    if(n < 0) return;
+    c->inLength += n;
+    c->in[c->inLength] = 0;
+
+    while(c->fd >= 0 && (newline = strchr(c->in, '\n')) != NULL) {
+        *newline = 0;
+        lineLength = newline - c->in + 1;
+        handleLine(c, c->in);
+        if(c->fd < 0) return;
+        c->inLength -= lineLength;
+        memmove(c->in, c->in + lineLength, c->inLength + 1);
+    }
+    if(c->inLength == sizeof(c->in) - 1) {
+        // no newline in a full buffer, not a client we understand
+        dropClient(c);
+    }
+}
+
+static void writeClient(struct client *c) {
+    ssize_t n = send(c->fd, c->out, c->outLength, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if(n < 0) {
+        if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) dropClient(c);
+        return;
+    }
+    c->outLength -= n;
+    memmove(c->out, c->out + n, c->outLength);
+}
+
+int runServer(struct monitor *mon, const char *path, int statsFd) {
+    struct sockaddr_un addr;
+    struct pollfd fds[SERVER_MAX_CLIENTS + 2 + STATS_POLL_FDS];
+    int map[SERVER_MAX_CLIENTS + 2 + STATS_POLL_FDS];
+    int listenfd, fd, nfds, i, t, timeout, rc = 0;
+
+    served = mon;
+    mon->onStatus = onServerStatus;
+    mon->onComplete = onServerComplete;
+    for(i = 0; i < SERVER_MAX_CLIENTS; ++i) clients[i].fd = -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr,"Socket path too long\n");
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+    listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listenfd < 0) {
+        fprintf(stderr,"Could not create socket\n");
+        return 1;
+    }
+    unlink(path);
+    if(bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listenfd, 16) < 0) {
+        fprintf(stderr,"Could not listen on %s\n",path);
+        close(listenfd);
+        return 1;
+    }
+
+    signal(SIGINT, onServerSignal);
+    signal(SIGTERM, onServerSignal);
+    signal(SIGPIPE, SIG_IGN);
+    fprintf(stdout,"Serving monitor @ %s on %s\n",mon->name,path);
+    fflush(stdout);
+
+    while(!stopServer) {
+        nfds = 0;
+        fds[nfds].fd = mon->fd;
+        fds[nfds].events = monitorPollEvents(mon);
+        map[nfds++] = -1;
+        fds[nfds].fd = listenfd;
+        fds[nfds].events = POLLIN;
+        map[nfds++] = -1;
+        statsPollFds(statsFd, &fds[nfds]);
+        for(i = 0; i < STATS_POLL_FDS; ++i) map[nfds++] = -1;
+        for(i = 0; i < SERVER_MAX_CLIENTS; ++i) {
+            if(clients[i].fd < 0) continue;
+            fds[nfds].fd = clients[i].fd;
+            fds[nfds].events = POLLIN | (clients[i].outLength ? POLLOUT : 0);
+            map[nfds++] = i;
+        }
+
+        timeout = monitorPollTimeout(mon);
+        t = statsPollTimeout();
+        if(t >= 0 && (timeout < 0 || t < timeout)) timeout = t;
+        if(poll(fds, nfds, timeout) < 0) {
+            if(errno == EINTR) continue;
+            fprintf(stderr,"Polling failed...\n");
+            rc = 1;
+            break;
+        }
+
+        if(fds[1].revents & POLLIN) {
+            fd = accept(listenfd, NULL, NULL);
+            if(fd >= 0) {
+                for(i = 0; i < SERVER_MAX_CLIENTS && clients[i].fd >= 0; ++i);
+                if(i == SERVER_MAX_CLIENTS) {
+                    close(fd);
+                } else {
+                    memset(&clients[i], 0, sizeof(clients[i]));
+                    clients[i].fd = fd;
+                }
+            }
+        }
+
+        statsHandleEvents(statsFd, &fds[2], mon, 1);
+
+        for(i = 2 + STATS_POLL_FDS; i < nfds; ++i) {
+            if(clients[map[i]].fd >= 0 && (fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                readClient(&clients[map[i]]);
+            }
+        }
+
+        if(monitorHandleEvents(mon, fds[0].revents)) {
+            fprintf(stderr,"Lost connection to monitor @ %s\n",mon->name);
+            rc = 1;
+            break;
+        }
+
+        // replies may have been queued by the monitor or by other clients
+        for(i = 0; i < SERVER_MAX_CLIENTS; ++i) {
+            if(clients[i].fd >= 0 && clients[i].outLength) writeClient(&clients[i]);
+        }
+    }
+
+    for(i = 0; i < SERVER_MAX_CLIENTS; ++i) {
+        if(clients[i].fd >= 0) close(clients[i].fd);
+    }
+    close(listenfd);
+    unlink(path);
+    return rc;
+}
@@ -0,0 +1,27 @@
+// Shared-connection daemon serving local clients over a Unix socket
+// (2022) Martin Hejnfelt (martin@hejnfelt.com)
+// See https://immerhax.com/?p=797 for more information
+// Licensed under the WTFPL, see LICENSE.txt
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "monitor.h"
+
+#define SERVER_MAX_CLIENTS  (32)
+#define SERVER_LINE_SIZE    (256)
+#define SERVER_OUT_SIZE     (4096)
+#define SERVER_MAX_TICKS    (255)
+
+// Owns the connection to mon and serves clients on the Unix socket at
+// path until interrupted. Line based, one request per line:
+//   status               -> status XXXX XXXX XXXX XXXX XXXX (cached)
+//   watch                -> ok, then a status line on every change
+//   send <command>       -> ok <command> / error <command> <reason>
+//   knob <knob> <ticks>  -> ok <knob> / error <knob> <reason>
+//   quit
+// Scrapes waiting on statsFd, if not -1, are answered from the same loop.
+// Returns 0 when interrupted, non-zero if the monitor connection was lost.
+int runServer(struct monitor *mon, const char *path, int statsFd);
+
+#endif
@@ -0,0 +1,298 @@
+// Per monitor counters and latency histograms, exported as Prometheus text
+// (2022) Martin Hejnfelt (martin@hejnfelt.com)
+// See https://immerhax.com/?p=797 for more information
+// Licensed under the WTFPL, see LICENSE.txt
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "stats.h"
+#include "monitor.h"
+
+#define STATS_SCRAPE_TIMEOUT_MS (1000)
+#define STATS_REQUEST_SIZE      (1024)
+#define STATS_HTTP_HEADER       "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n\r\n"
+
+const uint32_t statsBucketsUs[STATS_BUCKETS] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000
+};
+
+const char* statsSlotName(unsigned slot) {
+    if(slot < CMD_COUNT) return commands[slot].name;
+    return knobTargets[slot - CMD_COUNT];
+}
+
+static uint8_t slotUsed(const struct commandStats *s) {
+    return s->ok || s->timeouts || s->failures;
+}
+
+static void writeCounter(FILE *out, const char *name, const char *help, const struct monitor *mons, int count, size_t offset) {
+    int i;
+    fprintf(out,"# HELP %s %s\n# TYPE %s counter\n",name,help,name);
+    for(i = 0; i < count; ++i) {
+        fprintf(out,"%s{monitor=\"%s\"} %llu\n",name,mons[i].name,
+            (unsigned long long)*(const uint64_t*)((const uint8_t*)&mons[i].stats + offset));
+    }
+}
+
+void statsWrite(FILE *out, const struct monitor *mons, int count) {
+    static const char *results[] = { "ok", "timeout", "failed" };
+    const struct commandStats *s;
+    unsigned long long cumulative;
+    uint64_t values[3];
+    unsigned slot;
+    int i, b, r;
+
+    fprintf(out,"# HELP bkm_requests_total Requests completed, by command and result\n"
+                "# TYPE bkm_requests_total counter\n");
+    for(i = 0; i < count; ++i) {
+        for(slot = 0; slot < STAT_SLOTS; ++slot) {
+            s = &mons[i].stats.commands[slot];
+            if(!slotUsed(s)) continue;
+            values[0] = s->ok;
+            values[1] = s->timeouts;
+            values[2] = s->failures;
+            for(r = 0; r < 3; ++r) {
+                fprintf(out,"bkm_requests_total{monitor=\"%s\",command=\"%s\",result=\"%s\"} %llu\n",
+                    mons[i].name,statsSlotName(slot),results[r],(unsigned long long)values[r]);
+            }
+        }
+    }
+
+    fprintf(out,"# HELP bkm_request_latency_seconds Time from a request going out to its reply\n"
+                "# TYPE bkm_request_latency_seconds histogram\n");
+    for(i = 0; i < count; ++i) {
+        for(slot = 0; slot < STAT_SLOTS; ++slot) {
+            s = &mons[i].stats.commands[slot];
+            if(!slotUsed(s)) continue;
+            cumulative = 0;
+            for(b = 0; b < STATS_BUCKETS; ++b) {
+                cumulative += s->buckets[b];
+                fprintf(out,"bkm_request_latency_seconds_bucket{monitor=\"%s\",command=\"%s\",le=\"%g\"} %llu\n",
+                    mons[i].name,statsSlotName(slot),statsBucketsUs[b] / 1e6,cumulative);
+            }
+            fprintf(out,"bkm_request_latency_seconds_bucket{monitor=\"%s\",command=\"%s\",le=\"+Inf\"} %llu\n",
+                mons[i].name,statsSlotName(slot),(unsigned long long)s->ok);
+            fprintf(out,"bkm_request_latency_seconds_sum{monitor=\"%s\",command=\"%s\"} %.9f\n",
+                mons[i].name,statsSlotName(slot),s->latencyNs / 1e9);
+            fprintf(out,"bkm_request_latency_seconds_count{monitor=\"%s\",command=\"%s\"} %llu\n",
+                mons[i].name,statsSlotName(slot),(unsigned long long)s->ok);
+        }
+    }
+
+    writeCounter(out, "bkm_bytes_sent_total", "Bytes written to the monitor", mons, count,
+        offsetof(struct monitorStats, bytesSent));
+    writeCounter(out, "bkm_bytes_received_total", "Bytes read from the monitor", mons, count,
+        offsetof(struct monitorStats, bytesReceived));
+    writeCounter(out, "bkm_malformed_frames_total", "Garbage skipped in the monitor's byte stream", mons, count,
+        offsetof(struct monitorStats, malformed));
+    writeCounter(out, "bkm_connects_total", "Connections established", mons, count,
+        offsetof(struct monitorStats, connects));
+    writeCounter(out, "bkm_disconnects_total", "Connections lost", mons, count,
+        offsetof(struct monitorStats, disconnects));
+
+    fprintf(out,"# HELP bkm_connected Whether the monitor is connected\n# TYPE bkm_connected gauge\n");
+    for(i = 0; i < count; ++i) {
+        fprintf(out,"bkm_connected{monitor=\"%s\"} %d\n",mons[i].name,mons[i].fd >= 0 && !mons[i].connecting);
+    }
+    fprintf(out,"# HELP bkm_queue_depth Requests queued or in flight\n# TYPE bkm_queue_depth gauge\n");
+    for(i = 0; i < count; ++i) {
+        fprintf(out,"bkm_queue_depth{monitor=\"%s\"} %u\n",mons[i].name,mons[i].count);
+    }
+    fprintf(out,"# HELP bkm_status_poll_interval_seconds Current status poll interval, 0 if not polling\n"
+                "# TYPE bkm_status_poll_interval_seconds gauge\n");
+    for(i = 0; i < count; ++i) {
+        fprintf(out,"bkm_status_poll_interval_seconds{monitor=\"%s\"} %g\n",mons[i].name,
+            mons[i].autoPoll ? mons[i].pollInterval / 1000.0 : 0.0);
+    }
+}
+
+int statsListen(const char *spec) {
+    struct sockaddr_un unixAddr;
+    struct sockaddr_in inetAddr;
+    struct sockaddr *addr;
+    socklen_t length;
+    int fd, on = 1;
+
+    if(strchr(spec, '/')) {
+        memset(&unixAddr, 0, sizeof(unixAddr));
+        unixAddr.sun_family = AF_UNIX;
+        if(strlen(spec) >= sizeof(unixAddr.sun_path)) return -1;
+        strcpy(unixAddr.sun_path, spec);
+        unlink(spec);
+        addr = (struct sockaddr*)&unixAddr;
+        length = sizeof(unixAddr);
+    } else {
+        // scrapes are for this machine only
+        memset(&inetAddr, 0, sizeof(inetAddr));
+        inetAddr.sin_family = AF_INET;
+        inetAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        inetAddr.sin_port = htons(atoi(spec));
+        addr = (struct sockaddr*)&inetAddr;
+        length = sizeof(inetAddr);
+    }
+    fd = socket(addr->sa_family, SOCK_STREAM, 0);
+    if(fd < 0) return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if(bind(fd, addr, length) < 0 || listen(fd, 4) < 0) {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+// TCP scrapes are answered as HTTP once the request is in, the Unix socket
+// just gets the text. Everything is non-blocking and driven from the
+// caller's poll, a scrape that doesn't finish in time is dropped.
+struct scrape {
+    int fd;
+    uint8_t http;
+    uint8_t answering;
+    char request[STATS_REQUEST_SIZE];
+    size_t requestLength;
+    char *text;
+    size_t length;
+    size_t written;
+    uint64_t deadline;      // ns, monotonic
+};
+
+static struct scrape scrapes[STATS_MAX_SCRAPES] = {
+    [0 ... STATS_MAX_SCRAPES - 1] = { .fd = -1 }
+};
+
+static void endScrape(struct scrape *sc) {
+    close(sc->fd);
+    free(sc->text);
+    memset(sc, 0, sizeof(*sc));
+    sc->fd = -1;
+}
+
+static int answer(struct scrape *sc, const struct monitor *mons, int count) {
+    FILE *out = open_memstream(&sc->text, &sc->length);
+    if(out == NULL) return 1;
+    if(sc->http) fputs(STATS_HTTP_HEADER, out);
+    statsWrite(out, mons, count);
+    if(fclose(out)) return 1;
+    sc->answering = 1;
+    return 0;
+}
+
+// Returns non-zero once the scrape is done with, finished or failed
+static int writeScrape(struct scrape *sc) {
+    ssize_t n;
+    while(sc->written < sc->length) {
+        n = send(sc->fd, sc->text + sc->written, sc->length - sc->written, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if(n < 0) return !(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+        sc->written += n;
+    }
+    return 1;
+}
+
+static int readScrape(struct scrape *sc) {
+    ssize_t n;
+    for(;;) {
+        n = recv(sc->fd, sc->request + sc->requestLength, sizeof(sc->request) - 1 - sc->requestLength, MSG_DONTWAIT);
+        if(n == 0) return 1;
+        if(n < 0) return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+        sc->requestLength += n;
+        sc->request[sc->requestLength] = 0;
+        // the request is all read, closing on it unread resets the connection
+        if(strstr(sc->request, "\r\n\r\n") || sc->requestLength == sizeof(sc->request) - 1) return 1;
+    }
+}
+
+static void acceptScrapes(int fd, const struct monitor *mons, int count) {
+    struct sockaddr_storage peer;
+    socklen_t peerLength;
+    struct scrape *sc;
+    int c, i;
+
+    for(;;) {
+        for(i = 0; i < STATS_MAX_SCRAPES && scrapes[i].fd >= 0; ++i);
+        if(i == STATS_MAX_SCRAPES) return;
+        peerLength = sizeof(peer);
+        c = accept(fd, (struct sockaddr*)&peer, &peerLength);
+        if(c < 0) return;
+        fcntl(c, F_SETFL, fcntl(c, F_GETFL) | O_NONBLOCK);
+        sc = &scrapes[i];
+        sc->fd = c;
+        sc->http = peer.ss_family == AF_INET;
+        sc->deadline = monitorNow() + (uint64_t)STATS_SCRAPE_TIMEOUT_MS * 1000000ULL;
+        if(!sc->http && (answer(sc, mons, count) || writeScrape(sc))) endScrape(sc);
+    }
+}
+
+void statsPollFds(int fd, struct pollfd *fds) {
+    uint8_t full = 1;
+    int i;
+
+    for(i = 0; i < STATS_MAX_SCRAPES; ++i) {
+        fds[1 + i].fd = scrapes[i].fd;
+        fds[1 + i].events = scrapes[i].answering ? POLLOUT : POLLIN;
+        if(scrapes[i].fd < 0) full = 0;
+    }
+    // with every slot taken new scrapes wait in the backlog
+    fds[0].fd = full ? -1 : fd;
+    fds[0].events = POLLIN;
+}
+
+int statsPollTimeout(void) {
+    uint64_t now = 0, next = UINT64_MAX;
+    int i;
+
+    for(i = 0; i < STATS_MAX_SCRAPES; ++i) {
+        if(scrapes[i].fd >= 0 && scrapes[i].deadline < next) next = scrapes[i].deadline;
+    }
+    if(next == UINT64_MAX) return -1;
+    now = monitorNow();
+    return next <= now ? 0 : (next - now + 999999) / 1000000;
+}
+
+void statsHandleEvents(int fd, const struct pollfd *fds, const struct monitor *mons, int count) {
+    struct scrape *sc;
+    uint64_t now = monitorNow();
+    int i, rc;
+
+    for(i = 0; i < STATS_MAX_SCRAPES; ++i) {
+        sc = &scrapes[i];
+        if(sc->fd < 0 || fds[1 + i].fd != sc->fd) continue;
+        if(fds[1 + i].revents & (POLLERR | POLLNVAL)) {
+            endScrape(sc);
+            continue;
+        }
+        if(!sc->answering && (fds[1 + i].revents & (POLLIN | POLLHUP))) {
+            rc = readScrape(sc);
+            if(rc < 0 || (rc > 0 && answer(sc, mons, count))) {
+                endScrape(sc);
+                continue;
+            }
+        }
+        if(sc->answering && writeScrape(sc)) {
+            endScrape(sc);
+            continue;
+        }
+        if(now >= sc->deadline) endScrape(sc);
+    }
+    if(fds[0].fd >= 0 && (fds[0].revents & POLLIN)) acceptScrapes(fd, mons, count);
+}
+
+void statsClose(int fd, const char *spec) {
+    int i;
+    for(i = 0; i < STATS_MAX_SCRAPES; ++i) {
+        if(scrapes[i].fd >= 0) endScrape(&scrapes[i]);
+    }
+    if(fd < 0) return;
+    close(fd);
+    if(strchr(spec, '/')) unlink(spec);
+}
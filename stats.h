@@ -0,0 +1,74 @@
+// Per monitor counters and latency histograms, exported as Prometheus text
+// (2022) Martin Hejnfelt (martin@hejnfelt.com)
+// See https://immerhax.com/?p=797 for more information
+// Licensed under the WTFPL, see LICENSE.txt
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <poll.h>
+
+#include "protocol.h"
+
+// One slot per fixed command, then one per knob
+#define STAT_SLOTS          (CMD_COUNT + KNOB_NONE)
+#define STAT_KNOB(knob)     (CMD_COUNT + (knob))
+
+// Upper bounds of the latency buckets in us, everything slower lands in +Inf
+#define STATS_BUCKETS       (13)
+extern const uint32_t statsBucketsUs[STATS_BUCKETS];
+
+struct commandStats {
+    uint64_t ok;
+    uint64_t timeouts;
+    uint64_t failures;
+    uint64_t latencyNs;     // sum over ok
+    uint64_t buckets[STATS_BUCKETS + 1];
+};
+
+// Plain counters bumped from the engine, nothing is done with them until
+// someone asks for the text
+struct monitorStats {
+    struct commandStats commands[STAT_SLOTS];
+    uint64_t bytesSent;
+    uint64_t bytesReceived;
+    uint64_t malformed;
+    uint64_t connects;
+    uint64_t disconnects;
+};
+
+static inline void statsLatency(struct commandStats *s, uint64_t ns) {
+    uint32_t us = ns / 1000;
+    int i = 0;
+    while(i < STATS_BUCKETS && us > statsBucketsUs[i]) i++;
+    s->buckets[i]++;
+    s->latencyNs += ns;
+    s->ok++;
+}
+
+struct monitor;
+
+const char* statsSlotName(unsigned slot);
+
+// Writes the counters of all monitors in Prometheus text format
+void statsWrite(FILE *out, const struct monitor *mons, int count);
+
+// Scrapes answered at the same time, more wait in the listen backlog
+#define STATS_MAX_SCRAPES   (4)
+#define STATS_POLL_FDS      (1 + STATS_MAX_SCRAPES)
+
+// Listens for scrapes on a TCP port on localhost, or on a Unix socket if
+// spec is a path. Returns the listening socket, -1 on failure.
+int statsListen(const char *spec);
+// Scrapes are answered from the caller's poll loop without ever blocking
+// it. statsPollFds fills STATS_POLL_FDS entries, the listening socket fd
+// first, statsPollTimeout is when the oldest scrape gives up (-1 for none)
+// and statsHandleEvents accepts, reads and writes whatever poll reported.
+void statsPollFds(int fd, struct pollfd *fds);
+int statsPollTimeout(void);
+void statsHandleEvents(int fd, const struct pollfd *fds, const struct monitor *mons, int count);
+void statsClose(int fd, const char *spec);
+
+#endif